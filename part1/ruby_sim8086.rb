@@ -2,9 +2,9 @@
 # https://www.computerenhance.com/p/instruction-decoding-on-the-8086
 # https://www.computerenhance.com/p/decoding-multiple-instructions-and
 
-$stdout.sync = true
+require 'stringio'
 
-input_filename = ARGV.fetch(0)
+$stdout.sync = true
 
 RegNames = [
   %w{ al cl dl bl ah ch dh bh },
@@ -50,7 +50,7 @@ def decode_rm(mod, w, rm, input)
     if mod == 0b00
       if rm == 0b110
         # 16-bit direct address
-        return '[' + input.read(2).unpack('<S')[0].to_s + ']'
+        return '[' + input.read(2).unpack('v')[0].to_s + ']'
       end
       # No displacement
       disp = 0
@@ -59,7 +59,7 @@ def decode_rm(mod, w, rm, input)
       disp = input.read(1).unpack('c')[0]
     elsif mod == 0b10
       # 16-bit signed memory displacement
-      disp = input.read(2).unpack('<s')[0]
+      disp = input.read(2).unpack('s<')[0]
     end
     expr += " + #{disp}" if disp > 0
     expr += " - #{-disp}" if disp < 0
@@ -69,7 +69,7 @@ end
 
 def read_data(w, input)
   if w == 1
-    input.read(2).unpack('<S')[0]
+    input.read(2).unpack('v')[0]
   else
     input.read(1).ord
   end
@@ -77,7 +77,7 @@ end
 
 def read_data_signed(w, input)
   if w == 1
-    input.read(2).unpack('<S')[0]
+    input.read(2).unpack('v')[0]
   else
     input.read(1).unpack('c')[0]
   end
@@ -85,7 +85,7 @@ end
 
 def read_data_ws(w, s, input)
   if w == 1 && s == 0
-    input.read(2).unpack('<S')[0]
+    input.read(2).unpack('v')[0]
   else
     input.read(1).ord
   end
@@ -125,11 +125,12 @@ def decode(input)
   when byte0 >> 2 == 0b101000      # MOV: Memory <-> accumulator
     w = byte0[0]
     d = byte0[1]
-    addr = read_data(w, input)
+    addr = read_data(1, input)
+    acc = %w{al ax}.fetch(w)
     if d == 1
-      "mov [#{addr}], ax"
+      "mov [#{addr}], #{acc}"
     else
-      "mov ax, [#{addr}]"
+      "mov #{acc}, [#{addr}]"
     end
   when (byte0 & 0b11000100) == 0   # ADD/SUB/CMP: Register/memory with register
     byte1 = input.read(1).ord
@@ -169,9 +170,204 @@ def decode(input)
   end
 end
 
-input = File.open(input_filename, 'rb')
-puts "bits 16\n\n"
-while true
-  str = decode(input) or break
-  puts str
+# Table-driven decoder.  Instead of testing the first byte against each
+# opcode pattern in turn like decode does, it looks up the handler for it in
+# a 256-entry table built once from the same patterns.  It decodes from a
+# String by offset, so there is no IO call or unpack per byte.
+class TableDecoder
+  attr_reader :pos
+
+  def initialize(data, pos = 0)
+    @data = data
+    @pos = pos
+  end
+
+  # Returns the next instruction as text, or nil at the end.
+  def decode
+    return nil if @pos >= @data.bytesize
+    byte0 = @data.getbyte(@pos)
+    @pos += 1
+    Handlers[byte0].bind_call(self, byte0)
+  end
+
+  def next_byte
+    b = @data.getbyte(@pos)
+    @pos += 1
+    b
+  end
+
+  def next_signed_byte
+    b = next_byte
+    b >= 0x80 ? b - 0x100 : b
+  end
+
+  def next_word
+    w = @data.getbyte(@pos) | @data.getbyte(@pos + 1) << 8
+    @pos += 2
+    w
+  end
+
+  def next_signed_word
+    w = next_word
+    w >= 0x8000 ? w - 0x10000 : w
+  end
+
+  def next_data(w)
+    w == 1 ? next_word : next_byte
+  end
+
+  # Memory operands without a displacement, which we don't need to build.
+  PlainAddresses = AddressExprs.map { |e| "[#{e}]".freeze }.freeze
+
+  def rm(mod, w, rm)
+    case mod
+    when 0b11
+      return RegNames[w][rm]
+    when 0b00
+      return "[#{next_word}]" if rm == 0b110
+      return PlainAddresses[rm]
+    when 0b01
+      disp = next_signed_byte
+    else
+      disp = next_signed_word
+    end
+    if disp > 0
+      "[#{AddressExprs[rm]} + #{disp}]"
+    elsif disp < 0
+      "[#{AddressExprs[rm]} - #{-disp}]"
+    else
+      PlainAddresses[rm]
+    end
+  end
+
+  def mov_rm_reg(byte0)
+    byte1 = next_byte
+    op2 = RegNames.fetch(byte0[0]).fetch(byte1 >> 3 & 7)
+    op1 = rm(byte1 >> 6, byte0[0], byte1 & 7)
+    byte0[1] == 1 ? "mov #{op2}, #{op1}" : "mov #{op1}, #{op2}"
+  end
+
+  def mov_imm_rm(byte0)
+    w = byte0[0]
+    byte1 = next_byte
+    mod = byte1 >> 6
+    dest = rm(mod, w, byte1 & 7)
+    imm = next_data(w).to_s
+    imm = ["byte ", "word "].fetch(w) + imm if mod != 0b11
+    "mov #{dest}, #{imm}"
+  end
+
+  def mov_imm_reg(byte0)
+    w = byte0[3]
+    "mov #{RegNames.fetch(w).fetch(byte0 & 7)}, #{next_data(w)}"
+  end
+
+  def mov_acc(byte0)
+    addr = next_word
+    acc = %w{al ax}.fetch(byte0[0])
+    byte0[1] == 1 ? "mov [#{addr}], #{acc}" : "mov #{acc}, [#{addr}]"
+  end
+
+  def arith_rm_reg(byte0)
+    byte1 = next_byte
+    op = SimilarOps.fetch(byte0 >> 3 & 7)
+    op2 = RegNames.fetch(byte0[0]).fetch(byte1 >> 3 & 7)
+    op1 = rm(byte1 >> 6, byte0[0], byte1 & 7)
+    byte0[1] == 1 ? "#{op} #{op2}, #{op1}" : "#{op} #{op1}, #{op2}"
+  end
+
+  def arith_imm_rm(byte0)
+    byte1 = next_byte
+    w = byte0[0]
+    op = SimilarOps.fetch(byte1 >> 3 & 7)
+    op2 = rm(byte1 >> 6, w, byte1 & 7)
+    imm = w == 1 && byte0[1] == 0 ? next_word : next_byte
+    "#{op} #{["byte ", "word "].fetch(w)}#{op2}, #{imm}"
+  end
+
+  def arith_imm_acc(byte0)
+    w = byte0[0]
+    imm = w == 1 ? next_word : next_signed_byte
+    "#{SimilarOps.fetch(byte0 >> 3 & 7)} #{%w{al ax}.fetch(w)}, #{imm}"
+  end
+
+  def jump(byte0)
+    "#{DisplacementOps.fetch(byte0)} ($+2)+#{next_signed_byte}"
+  end
+
+  def unknown(byte0)
+    raise NotImplementedError, "byte0 = 0x%X" % byte0
+  end
+
+  # Checked in the same order as the case in decode, since some patterns
+  # overlap.
+  Opcodes = Array.new(256) do |b|
+    if b >> 2 == 0b100010 then :mov_rm_reg
+    elsif b >> 1 == 0b1100011 then :mov_imm_rm
+    elsif b >> 4 == 0b1011 then :mov_imm_reg
+    elsif b >> 2 == 0b101000 then :mov_acc
+    elsif (b & 0b11000100) == 0 then :arith_rm_reg
+    elsif (b & 0b11000100) == 0x80 then :arith_imm_rm
+    elsif (b & 0b11000100) == 0x04 then :arith_imm_acc
+    elsif DisplacementOps.key?(b) then :jump
+    else :unknown
+    end
+  end.freeze
+
+  Handlers = Opcodes.map { |name| instance_method(name) }.freeze
+end
+
+def decode_all_io(data)
+  input = StringIO.new(data)
+  output = []
+  while (str = decode(input))
+    output << str
+  end
+  output
+end
+
+def decode_all_table(data)
+  decoder = TableDecoder.new(data)
+  output = []
+  while (str = decoder.decode)
+    output << str
+  end
+  output
 end
+
+# Decodes the listings, concatenated 'repeat' times, with both decoders and
+# prints how many instructions per second each one does.
+def benchmark(filenames, repeat)
+  data = filenames.map { |f| File.binread(f) }.join * repeat
+  results = {}
+  { io: :decode_all_io, table: :decode_all_table }.each do |name, method|
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    output = send(method, data)
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    results[name] = output
+    puts "%-6s %10d instructions in %7.3f s: %10.0f instructions/s" %
+      [name, output.size, elapsed, output.size / elapsed]
+  end
+  if results[:io] != results[:table]
+    $stderr.puts "Error: The decoders don't agree."
+    exit 1
+  end
+end
+
+# Usage: ruby ruby_sim8086.rb [--io] PROGRAM
+#        ruby ruby_sim8086.rb --bench N PROGRAM...
+#
+# Prints the assembly for a program, using the table-driven decoder unless
+# --io says to use the original one.  --bench N decodes the programs, all
+# concatenated N times, with each decoder and compares their speed.
+if ARGV.first == '--bench'
+  ARGV.shift
+  repeat = ARGV.shift.to_i
+  benchmark(ARGV, repeat)
+  exit
+end
+
+use_io = ARGV.delete('--io')
+data = File.binread(ARGV.fetch(0))
+puts "bits 16\n\n"
+(use_io ? decode_all_io(data) : decode_all_table(data)).each { |s| puts s }
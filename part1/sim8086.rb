@@ -8,6 +8,48 @@
 require 'C:/Users/david/Documents/computer_enhance/perfaware/sim86/shared/contrib_ruby/sim86'
 
 class Sim
+  # What we keep from the decoder for each instruction, so we don't have to
+  # decode it again or look things up by name each time it runs.  The
+  # operands are Operands, except for jump displacements, which are Integers.
+  Decoded = Struct.new(:op, :size, :o1, :o2)
+
+  # An operand worked out when the instruction is decoded, so running it
+  # doesn't look anything up in the decoder's hashes.  kind is :imm, :reg, or
+  # :mem.  register and address_registers are indexes into @registers.
+  Operand = Struct.new(:kind, :value, :register, :offset, :count,
+    :address_registers, :displacement, :ea_cycles)
+
+  # The longest 8086 instruction is 6 bytes.
+  MaxInstructionSize = 6
+
+  # Clocks for each operand form, from the 8086 manual, and how many word
+  # transfers to or from memory each one does.  Memory forms also pay for
+  # the effective address calculation.
+  Timings = {
+    mov: { reg_reg: [2, 0], reg_mem: [8, 1], mem_reg: [9, 1],
+           reg_imm: [4, 0], mem_imm: [10, 1],
+           acc_mem: [10, 1], mem_acc: [10, 1] },
+    add: { reg_reg: [3, 0], reg_mem: [9, 1], mem_reg: [16, 2],
+           reg_imm: [4, 0], mem_imm: [17, 2] },
+    cmp: { reg_reg: [3, 0], reg_mem: [9, 1], mem_reg: [9, 1],
+           reg_imm: [4, 0], mem_imm: [10, 1] },
+  }
+  Timings[:sub] = Timings[:add]
+
+  # Effective address clocks by the registers in the address (sim86 register
+  # numbers: 2 = bx, 6 = bp, 7 = si, 8 = di).  A displacement adds 4, except
+  # on its own.
+  EACycles = {
+    [] => 6,
+    [2] => 5, [6] => 5, [7] => 5, [8] => 5,
+    [2, 7] => 7, [6, 8] => 7,
+    [2, 8] => 8, [6, 7] => 8,
+  }
+
+  # A word transfer takes an extra 4 clocks if it is split into two bus
+  # cycles: at an odd address on the 8086, and always on the 8088.
+  TransferPenalty = 4
+
   attr_accessor :memory
   attr_accessor :program_end
   attr_accessor :ip
@@ -18,8 +60,21 @@ class Sim
     @registers = [0] * 12
     @zero_flag = false
     @sign_flag = false
+    @decoded = []  # by IP
+    @instruction_count = 0
+
+    # Set cpu to :i8086 or :i8088 to count clocks.
+    @cpu = nil
+    @trace_cycles = false
+    @total_cycles = 0
+    @ip_cycles = Hash.new(0)
+    @ip_counts = Hash.new(0)
   end
 
+  attr_reader :instruction_count
+  attr_accessor :cpu
+  attr_accessor :trace_cycles
+
   def load_program(program)
     @program_end = program.size
     @memory = program.ljust(64 * 1024, "\x00")
@@ -39,85 +94,198 @@ class Sim
       ~(0xFF << shift) | (value & 0xFF) << shift
   end
 
-  def calculate_address_term(term)
-    return 0 if term.nil? || term.fetch(:register) == 0
-    raise NotImplementedError, term.inspect if term.fetch(:offset) != 0
-    @registers.fetch(term[:register] - 1)
-  end
-
   def calculate_address(operand)
-    calculate_address_term(operand[:t0]) +
-      calculate_address_term(operand[:t1]) +
-      operand.fetch(:displacement, 0)
+    address = operand.displacement
+    operand.address_registers.each { |r| address += @registers[r] }
+    address
   end
 
   def operand_read(operand)
-    if operand.is_a?(Integer)
-      operand
-    elsif operand.key?(:register)
-      value = 0
-      operand.fetch(:count).times do |i|
-        offset = operand.fetch(:offset)
-        value |= reg_read_byte(operand[:register] - 1, offset + i) << (i * 8)
+    case operand.kind
+    when :imm
+      operand.value
+    when :reg
+      if operand.count == 2
+        @registers[operand.register]
+      else
+        reg_read_byte(operand.register, operand.offset)
       end
-      value
-    elsif operand.key?(:t0) || operand.key?(:t1) || operand.key?(:displacement)
+    when :mem
       address = calculate_address(operand)
       # Assumption: 16-bit memory read
       @memory[address + 0].ord | @memory[address + 1].ord << 8
-    else
-      raise NotImplementedError, "operand read: #{operand.inspect}"
     end
   end
 
   def operand_write(operand, value)
-    if operand.is_a?(Integer)
+    case operand.kind
+    when :imm
       raise NotSupportedError
-    elsif operand.key?(:register)
-      operand.fetch(:count).times do |i|
-        reg_write_byte(operand[:register] - 1, operand.fetch(:offset) + i, value & 0xFF)
-        value >>= 8
+    when :reg
+      if operand.count == 2
+        @registers[operand.register] = value & 0xFFFF
+      else
+        reg_write_byte(operand.register, operand.offset, value)
       end
-    elsif operand.key?(:t0) || operand.key?(:t1) || operand.key?(:displacement)
+    when :mem
       address = calculate_address(operand)
       # Assumption: 16-bit memory write
       @memory[address + 0] = (value & 0xFF).chr
       @memory[address + 1] = (value >> 8 & 0xFF).chr
+      invalidate_decoded(address, 2)
+    end
+  end
+
+  # Turns one of the decoder's operand hashes into an Operand.
+  def resolve_operand(operand)
+    if operand.nil?
+      nil
+    elsif operand.is_a?(Integer)
+      Operand.new(:imm, operand).freeze
+    elsif operand.key?(:register)
+      Operand.new(:reg, nil, operand.fetch(:register) - 1,
+        operand.fetch(:offset), operand.fetch(:count)).freeze
+    elsif operand.key?(:t0) || operand.key?(:t1) || operand.key?(:displacement)
+      terms = [operand[:t0], operand[:t1]].compact
+        .reject { |t| t.fetch(:register) == 0 }
+      terms.each do |t|
+        raise NotImplementedError, t.inspect if t.fetch(:offset) != 0
+      end
+      numbers = terms.map { |t| t.fetch(:register) }.sort
+      displacement = operand.fetch(:displacement, 0)
+      ea = EACycles[numbers]
+      ea += 4 if ea && !numbers.empty? && displacement != 0
+      Operand.new(:mem, nil, nil, nil, nil, numbers.map { |n| n - 1 },
+        displacement, ea).freeze
     else
-      raise NotImplementedError, "operand write: #{operand.inspect}"
+      raise NotImplementedError, "operand: #{operand.inspect}"
+    end
+  end
+
+  def decode(ip)
+    inst = Sim86.decode_8086_instruction(@memory, ip)
+    op = inst.fetch(:op)
+    if op == :jne || op == :loop
+      o1 = inst[:o1]
+    else
+      o1 = resolve_operand(inst[:o1])
+    end
+    Decoded.new(op, inst.fetch(:size), o1, resolve_operand(inst[:o2])).freeze
+  end
+
+  # Forgets the decoded instructions that overlap the bytes we wrote, so
+  # self-modifying code still works.
+  def invalidate_decoded(address, size)
+    first = [address - MaxInstructionSize + 1, 0].max
+    (first...(address + size)).each { |a| @decoded[a] = nil }
+  end
+
+  def accumulator?(operand)
+    operand.kind == :reg && operand.register == 0
+  end
+
+  def ea_cycles(operand)
+    operand.ea_cycles or raise KeyError,
+      "No timing for address #{operand.address_registers.inspect}"
+  end
+
+  # Returns the clocks for an instruction that is about to run, as base,
+  # effective address, and transfer penalty clocks.
+  def instruction_cycles(inst)
+    case inst.op
+    when :jne
+      return [@zero_flag ? 4 : 16, 0, 0]
+    when :loop
+      return [@registers[2] == 1 ? 5 : 17, 0, 0]
+    end
+
+    form = :"#{inst.o1.kind}_#{inst.o2.kind}"
+    memory = [inst.o1, inst.o2].find { |o| o.kind == :mem }
+    ea = memory ? ea_cycles(memory) : 0
+
+    # mov between the accumulator and a direct address has its own encoding,
+    # which doesn't calculate an address.
+    if inst.op == :mov && memory && memory.address_registers.empty?
+      if form == :reg_mem && accumulator?(inst.o1)
+        form = :acc_mem
+        ea = 0
+      elsif form == :mem_reg && accumulator?(inst.o2)
+        form = :mem_acc
+        ea = 0
+      end
+    end
+
+    base, transfers = Timings.dig(inst.op, form)
+    raise NotImplementedError, "No timing for #{inst.op} #{form}" if !base
+
+    penalty = 0
+    if transfers > 0 && (@cpu == :i8088 || calculate_address(memory).odd?)
+      penalty = transfers * TransferPenalty
+    end
+    [base, ea, penalty]
+  end
+
+  def count_cycles(inst, ip)
+    base, ea, penalty = instruction_cycles(inst)
+    cycles = base + ea + penalty
+    @total_cycles += cycles
+    @ip_cycles[ip] += cycles
+    @ip_counts[ip] += 1
+    return if !@trace_cycles
+
+    detail = ''
+    if ea > 0 || penalty > 0
+      detail = " (#{base}"
+      detail << " + #{ea}ea" if ea > 0
+      detail << " + #{penalty}p" if penalty > 0
+      detail << ')'
+    end
+    puts "0x%04X %-4s ; Clocks: +%d = %d%s" %
+      [ip, inst.op, cycles, @total_cycles, detail]
+  end
+
+  def print_cycles
+    puts "Total clocks (%d): %d" % [@cpu == :i8088 ? 8088 : 8086, @total_cycles]
+    puts "Hot spots:"
+    puts "      IP  Op        Count      Clocks   Share"
+    @ip_cycles.sort_by { |ip, cycles| [-cycles, ip] }.each do |ip, cycles|
+      puts "  0x%04X  %-4s %10d %11d  %5.1f%%" % [ip, @decoded[ip]&.op,
+        @ip_counts[ip], cycles, 100.0 * cycles / @total_cycles]
     end
   end
 
   def run_instruction
-    inst = Sim86.decode_8086_instruction(@memory, @ip)
+    inst = (@decoded[@ip] ||= decode(@ip))
     #puts "Run inst at ip=#{@ip}: #{inst.inspect}"
 
     orig_ip = @ip
-    op = inst.fetch(:op)
-    @ip += inst.fetch(:size)
+    count_cycles(inst, orig_ip) if @cpu
+    op = inst.op
+    @ip += inst.size
+    @instruction_count += 1
     case op
     when :mov
-      value = operand_read(inst.fetch(:o2))
-      operand_write(inst.fetch(:o1), value)
+      value = operand_read(inst.o2)
+      operand_write(inst.o1, value)
     when :add
-      v2 = operand_read(inst.fetch(:o2))
-      v1 = operand_read(inst.fetch(:o1))
+      v2 = operand_read(inst.o2)
+      v1 = operand_read(inst.o1)
       result = (v1 + v2) & 0xFFFF
       @zero_flag = result == 0
       @sign_flag = result & 0x8000 != 0
-      operand_write(inst.fetch(:o1), result)
+      operand_write(inst.o1, result)
     when :sub, :cmp
-      v2 = operand_read(inst.fetch(:o2))
-      v1 = operand_read(inst.fetch(:o1))
+      v2 = operand_read(inst.o2)
+      v1 = operand_read(inst.o1)
       result = (v1 - v2) & 0xFFFF
       @zero_flag = result == 0
       @sign_flag = result & 0x8000 != 0
-      operand_write(inst.fetch(:o1), result) if op == :sub
+      operand_write(inst.o1, result) if op == :sub
     when :jne
-      @ip += inst.fetch(:o1) if !@zero_flag
+      @ip += inst.o1 if !@zero_flag
     when :loop
       @registers[2] -= 1
-      @ip += inst.fetch(:o1) if @registers[2] != 0
+      @ip += inst.o1 if @registers[2] != 0
     else
       raise NotImplementedError, "Unimplemented op #{op} at ip=#{orig_ip}"
     end
@@ -146,14 +314,28 @@ end
 
 $stdout.sync = true
 
+# Usage: ruby sim8086.rb [--cycles | --8088] [--trace] PROGRAM
+#
+# --cycles: Estimate the 8086 clocks for each instruction we run, and print
+#   the total and the instructions that took the most time.
+# --8088: Same, but for the 8088, which has an 8-bit bus.
+# --trace: Also print the clocks of every instruction as it runs.
+sim = Sim.new
+sim.cpu = :i8086 if ARGV.delete('--cycles')
+sim.cpu = :i8088 if ARGV.delete('--8088')
+sim.trace_cycles = true if ARGV.delete('--trace')
 input_filename = ARGV.fetch(0)
 
-sim = Sim.new
 sim.load_program File.open(input_filename, 'rb') { |f| f.read }
 
+start_time = Process.clock_gettime(Process::CLOCK_MONOTONIC)
 while sim.valid_ip?
   sim.run_instruction
 end
+elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start_time
 
 sim.print_state
+sim.print_cycles if sim.cpu
+$stderr.puts "Instructions: %d in %.3f s (%.0f/s)" %
+  [sim.instruction_count, elapsed, sim.instruction_count / elapsed]
 sim.save_image 'output.data'
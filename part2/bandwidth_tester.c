@@ -0,0 +1,204 @@
+// Multi-core memory bandwidth tester.
+//
+// Runs the read_loop kernel from cache_tester.asm on 1 to N threads at the
+// same time.  Each thread is pinned to its own physical core and reads from
+// its own buffer, which is allocated either on the NUMA node of that core
+// ("local", the default) or on the next node over ("remote").  This tells us
+// how many cores it takes to saturate the memory bus and how much it costs to
+// read memory attached to another socket.
+//
+// Usage: bandwidth_tester [max_threads] [local|remote]
+//
+// Only the cores in processor group 0 (the first 64 logical processors) are
+// used, so on bigger machines the test doesn't cover every core.
+//
+// Output is CSV: thread count, working set size per thread, aggregate GiB/s,
+// and then the GiB/s of each thread during the best round.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+// Bytes each thread reads per round.  This is also the size of each thread's
+// buffer, so it is the largest working set we test.
+const size_t data_size = 256 << 20;
+
+// Smallest working set we test.
+const size_t min_use_length = 16 << 10;
+
+void read_loop(size_t data_length, void * data, size_t mask);
+
+typedef struct BandwidthThread
+{
+  HANDLE handle;
+  DWORD processor;
+  UCHAR node;
+  uint8_t * data;
+
+  // Time this thread took in the last round.
+  uint64_t time;
+
+  // Time this thread took in the best round so far.
+  uint64_t best_round_time;
+} BandwidthThread;
+
+#define MAX_THREADS 64
+
+BandwidthThread threads[MAX_THREADS];
+
+// These are only written by the main thread while the workers are waiting on
+// start_barrier.
+SYNCHRONIZATION_BARRIER start_barrier, done_barrier;
+volatile bool stop_threads;
+volatile size_t use_length;
+
+static DWORD WINAPI bandwidth_thread(void * param)
+{
+  BandwidthThread * t = param;
+  while (true)
+  {
+    EnterSynchronizationBarrier(&start_barrier, 0);
+    if (stop_threads) { break; }
+    uint64_t start_tsc = __rdtsc();
+    read_loop(data_size, t->data, use_length - 1);
+    t->time = __rdtsc() - start_tsc;
+    EnterSynchronizationBarrier(&done_barrier, 0);
+  }
+  return 0;
+}
+
+// Finds the first logical processor of each physical core, so that we don't
+// put two threads on the same core with Hyper-Threading.
+// Note: This only looks at the current processor group (64 processors).
+static size_t find_core_processors(DWORD * processors, size_t capacity)
+{
+  // The list also has caches, packages, and NUMA nodes, so it can be long
+  // on big servers.  The first call tells us how long.
+  DWORD length = 0;
+  GetLogicalProcessorInformation(NULL, &length);
+  SYSTEM_LOGICAL_PROCESSOR_INFORMATION * info = malloc(length);
+  if (info == NULL || !GetLogicalProcessorInformation(info, &length))
+  {
+    fprintf(stderr, "GetLogicalProcessorInformation failed.\n");
+    exit(1);
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < length / sizeof(info[0]) && count < capacity; i++)
+  {
+    if (info[i].Relationship != RelationProcessorCore) { continue; }
+    processors[count++] = __builtin_ctzll(info[i].ProcessorMask);
+  }
+  free(info);
+  return count;
+}
+
+// Runs one round of read_loop on each thread repeatedly, keeping the round
+// where all threads together finished the fastest.  The time of a round runs
+// from when the main thread releases the workers until the last one finishes.
+static void perform_repeat_test(size_t thread_count)
+{
+  repeat_test_init();
+  while (repeat_test_continue())
+  {
+    uint64_t best_time = global_rt.best_time;
+    repeat_test_sample_start();
+    EnterSynchronizationBarrier(&start_barrier, 0);
+    EnterSynchronizationBarrier(&done_barrier, 0);
+    repeat_test_sample_end();
+
+    if (global_rt.best_time < best_time)
+    {
+      for (size_t i = 0; i < thread_count; i++)
+      {
+        threads[i].best_round_time = threads[i].time;
+      }
+    }
+  }
+
+  printf("%zu,%zu,%4.2f", thread_count, use_length,
+    calculate_gib_per_s(thread_count * data_size, global_rt.best_time));
+  for (size_t i = 0; i < thread_count; i++)
+  {
+    printf(",%4.2f",
+      calculate_gib_per_s(data_size, threads[i].best_round_time));
+  }
+  printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+  size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : MAX_THREADS;
+  bool remote = argc > 2 && 0 == strcmp(argv[2], "remote");
+
+  DWORD processors[MAX_THREADS];
+  size_t core_count = find_core_processors(processors, MAX_THREADS);
+  if (max_threads == 0 || max_threads > core_count) { max_threads = core_count; }
+
+  ULONG highest_node;
+  GetNumaHighestNodeNumber(&highest_node);
+  if (remote && highest_node == 0)
+  {
+    fprintf(stderr, "Warning: Only one NUMA node, so remote is the same as local.\n");
+  }
+
+  repeat_test_init();
+  printf("tsc_frequency: %llu\n", tsc_frequency);
+  printf("NUMA nodes: %lu\n", highest_node + 1);
+
+  for (size_t i = 0; i < max_threads; i++)
+  {
+    BandwidthThread * t = &threads[i];
+    t->processor = processors[i];
+    GetNumaProcessorNode(t->processor, &t->node);
+    UCHAR data_node = t->node;
+    if (remote) { data_node = (t->node + 1) % (highest_node + 1); }
+
+    // The preferred node decides where the physical pages come from, even
+    // though the main thread is the one that touches them first.
+    t->data = VirtualAllocExNuma(GetCurrentProcess(), NULL, data_size,
+      MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, data_node);
+    if (t->data == NULL)
+    {
+      fprintf(stderr, "Failed to allocate memory on node %u.\n", data_node);
+      return 1;
+    }
+    memset(t->data, 1, data_size);
+
+    printf("thread %zu: processor %lu, node %u, data on node %u\n",
+      i, t->processor, t->node, data_node);
+  }
+
+  for (size_t thread_count = 1; thread_count <= max_threads; thread_count++)
+  {
+    // The main thread takes part in both barriers.
+    InitializeSynchronizationBarrier(&start_barrier, thread_count + 1, -1);
+    InitializeSynchronizationBarrier(&done_barrier, thread_count + 1, -1);
+    stop_threads = false;
+    use_length = data_size;
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+      BandwidthThread * t = &threads[i];
+      t->handle = CreateThread(NULL, 0, bandwidth_thread, t, 0, NULL);
+      SetThreadAffinityMask(t->handle, (DWORD_PTR)1 << t->processor);
+    }
+
+    while (use_length >= min_use_length)
+    {
+      perform_repeat_test(thread_count);
+      use_length >>= 1;
+    }
+
+    stop_threads = true;
+    EnterSynchronizationBarrier(&start_barrier, 0);
+    for (size_t i = 0; i < thread_count; i++)
+    {
+      WaitForSingleObject(threads[i].handle, INFINITE);
+      CloseHandle(threads[i].handle);
+    }
+    DeleteSynchronizationBarrier(&start_barrier);
+    DeleteSynchronizationBarrier(&done_barrier);
+  }
+}
@@ -0,0 +1,420 @@
+// Benchmark runner.
+//
+// Links the assembly kernels from the other programs in this directory into
+// one binary so a machine's performance baseline can be measured unattended
+// and compared against the last run.  Every test uses the same repetition
+// tester settings and runs pinned to one CPU if asked.
+//
+// Usage: bench [options] [name...]
+//
+// Each name selects the benchmarks whose names start with it.  With no names,
+// everything runs.  Options:
+//   --list          Print the benchmark names and exit.
+//   --seconds N     Stop each test N seconds after its last best time
+//                   (default 3).
+//   --cpu N         Pin to logical processor N.
+//   --stable        Warm up until the clock speed is steady before each test,
+//                   and leave out samples disturbed by migrations, frequency
+//                   changes, or interrupts (see repeat_test_stable in
+//                   profile.h).  Pins to the current processor unless --cpu
+//                   says otherwise.
+//   --max-size N    Largest buffer size to test, in bytes (default 1 GiB).
+//   --prefetch N    Prefetch distance for read_prefetch, in bytes
+//                   (default 1024).
+//   --output FILE   Write the results to FILE (default bench_results.csv).
+//   --compare FILE  Print how each result changed from the results in FILE,
+//                   which came from an earlier run.
+//
+// The results file is CSV with one row per test: name, size, TSC cycles per
+// unit, unit, units processed per sample, best cycles, best microseconds,
+// GiB/s (only for tests that process bytes), and how much the result can be
+// trusted (low, medium, or high).  A test where --stable left out every
+// sample has no numbers and "failed" instead, and makes bench exit with 1.
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "profile.h"
+#include "pointer_chase.h"
+#include "loop_variants.h"
+
+//// Kernels ///////////////////////////////////////////////////////////////////
+
+// cache_tester.asm
+void read_loop(size_t data_length, void * data, size_t mask);
+
+// rw_port_tester.asm
+void read_loop1(size_t data_length, void * data);
+void read_loop2(size_t data_length, void * data);
+void read_loop3(size_t data_length, void * data);
+void read_loop4(size_t data_length, void * data);
+void write_loop1(size_t data_length, void * data);
+void write_loop2(size_t data_length, void * data);
+void write_loop3(size_t data_length, void * data);
+void write_loop4(size_t data_length, void * data);
+
+// write_bytes.asm
+void mov_all_bytes_asm(size_t count, void * data);
+
+// store_tester.asm
+void write_16(size_t data_length, void * data);
+void write_32(size_t data_length, void * data);
+void write_64(size_t data_length, void * data);
+void nt_write_16(size_t data_length, void * data);
+void nt_write_32(size_t data_length, void * data);
+void nt_write_64(size_t data_length, void * data);
+void rep_stosb(size_t data_length, void * data);
+void read_plain(size_t data_length, void * data);
+void read_prefetch(size_t data_length, void * data, size_t distance);
+
+// Bytes read_loop reads per sample, no matter how small the working set is.
+const size_t read_loop_length = 256 << 20;
+
+// Loads chase_loop does per sample.
+const size_t chase_load_count = 1 << 20;
+
+// Roughly how many instructions a loop variant runs per sample.
+const uint64_t loop_instructions_per_sample = 1 << 24;
+
+size_t prefetch_distance = 1024;
+void * chase_start;
+
+// Each of these runs a kernel once on the first 'size' bytes of 'data' and
+// returns how many units (bytes, loads, ...) it processed.
+
+static size_t run_read_loop(size_t size, uint8_t * data)
+{
+  read_loop(read_loop_length, data, size - 1);
+  return read_loop_length;
+}
+
+static size_t run_read_prefetch(size_t size, uint8_t * data)
+{
+  read_prefetch(size, data, prefetch_distance);
+  return size;
+}
+
+static void setup_chase(size_t size, uint8_t * data)
+{
+  chase_start = build_chain(data, size);
+}
+
+static size_t run_chase(size_t size, uint8_t * data)
+{
+  chase_start = chase_loop(chase_load_count, chase_start);
+  return chase_load_count;
+}
+
+#define SIMPLE_KERNEL(func) \
+  static size_t run_##func(size_t size, uint8_t * data) \
+  { func(size, data); return size; }
+
+SIMPLE_KERNEL(read_loop1)
+SIMPLE_KERNEL(read_loop2)
+SIMPLE_KERNEL(read_loop3)
+SIMPLE_KERNEL(read_loop4)
+SIMPLE_KERNEL(write_loop1)
+SIMPLE_KERNEL(write_loop2)
+SIMPLE_KERNEL(write_loop3)
+SIMPLE_KERNEL(write_loop4)
+SIMPLE_KERNEL(mov_all_bytes_asm)
+SIMPLE_KERNEL(write_16)
+SIMPLE_KERNEL(write_32)
+SIMPLE_KERNEL(write_64)
+SIMPLE_KERNEL(nt_write_16)
+SIMPLE_KERNEL(nt_write_32)
+SIMPLE_KERNEL(nt_write_64)
+SIMPLE_KERNEL(rep_stosb)
+SIMPLE_KERNEL(read_plain)
+
+//// Benchmark list ////////////////////////////////////////////////////////////
+
+typedef struct Benchmark
+{
+  const char * name;
+  size_t (*run)(size_t size, uint8_t * data);
+
+  // Optional: prepares the buffer before each size is tested.
+  void (*setup)(size_t size, uint8_t * data);
+
+  // Sizes to test, going up by a factor of 4.  For the port tests, the size is
+  // just the number of operations.
+  size_t min_size, max_size;
+
+  const char * unit;
+  const char * feature;  // CPU feature needed, or NULL
+} Benchmark;
+
+#define KiB(n) ((size_t)(n) << 10)
+#define MiB(n) ((size_t)(n) << 20)
+#define GiB(n) ((size_t)(n) << 30)
+
+Benchmark benchmarks[] = {
+  { "read_loop", run_read_loop, NULL, KiB(16), GiB(1), "byte" },
+  { "read_plain", run_read_plain, NULL, KiB(16), GiB(1), "byte" },
+  { "read_prefetch", run_read_prefetch, NULL, KiB(16), GiB(1), "byte" },
+  { "write_16", run_write_16, NULL, KiB(16), GiB(1), "byte" },
+  { "write_32", run_write_32, NULL, KiB(16), GiB(1), "byte", "avx" },
+  { "write_64", run_write_64, NULL, KiB(16), GiB(1), "byte", "avx512f" },
+  { "nt_write_16", run_nt_write_16, NULL, KiB(16), GiB(1), "byte" },
+  { "nt_write_32", run_nt_write_32, NULL, KiB(16), GiB(1), "byte", "avx" },
+  { "nt_write_64", run_nt_write_64, NULL, KiB(16), GiB(1), "byte", "avx512f" },
+  { "rep_stosb", run_rep_stosb, NULL, KiB(16), GiB(1), "byte" },
+  { "mov_all_bytes", run_mov_all_bytes_asm, NULL, MiB(256), MiB(256), "byte" },
+  { "chase", run_chase, setup_chase, KiB(4), GiB(1), "load" },
+  { "port_read_loop1", run_read_loop1, NULL, MiB(256), MiB(256), "op" },
+  { "port_read_loop2", run_read_loop2, NULL, MiB(256), MiB(256), "op" },
+  { "port_read_loop3", run_read_loop3, NULL, MiB(256), MiB(256), "op" },
+  { "port_read_loop4", run_read_loop4, NULL, MiB(256), MiB(256), "op" },
+  { "port_write_loop1", run_write_loop1, NULL, MiB(256), MiB(256), "op" },
+  { "port_write_loop2", run_write_loop2, NULL, MiB(256), MiB(256), "op" },
+  { "port_write_loop3", run_write_loop3, NULL, MiB(256), MiB(256), "op" },
+  { "port_write_loop4", run_write_loop4, NULL, MiB(256), MiB(256), "op" },
+  { NULL },
+};
+
+static bool cpu_supports(const char * feature)
+{
+  if (feature == NULL) { return true; }
+  __builtin_cpu_init();
+  if (0 == strcmp(feature, "avx")) { return __builtin_cpu_supports("avx"); }
+  if (0 == strcmp(feature, "avx512f")) { return __builtin_cpu_supports("avx512f"); }
+  return false;
+}
+
+//// Results ///////////////////////////////////////////////////////////////////
+
+typedef struct BenchResult
+{
+  char name[64];
+  size_t size;
+  double cycles_per_unit;
+} BenchResult;
+
+#define MAX_RESULTS 4096
+
+BenchResult previous_results[MAX_RESULTS];
+size_t previous_result_count;
+
+static void load_previous_results(const char * filename)
+{
+  FILE * file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Warning: Cannot open %s, not comparing.\n", filename);
+    return;
+  }
+  char line[256];
+  fgets(line, sizeof(line), file);  // header
+  while (fgets(line, sizeof(line), file) && previous_result_count < MAX_RESULTS)
+  {
+    BenchResult * r = &previous_results[previous_result_count];
+    if (3 == sscanf(line, "%63[^,],%zu,%lf", r->name, &r->size, &r->cycles_per_unit))
+    {
+      previous_result_count++;
+    }
+  }
+  fclose(file);
+}
+
+static BenchResult * find_previous_result(const char * name, size_t size)
+{
+  for (size_t i = 0; i < previous_result_count; i++)
+  {
+    BenchResult * r = &previous_results[i];
+    if (r->size == size && 0 == strcmp(r->name, name)) { return r; }
+  }
+  return NULL;
+}
+
+FILE * output_file;
+bool any_failed;
+
+static void report(const char * name, size_t size, const char * unit,
+  size_t count)
+{
+  if (!repeat_test_has_result())
+  {
+    fprintf(output_file, "%s,%zu,,%s,%zu,,,,failed\n", name, size, unit,
+      count);
+    fflush(output_file);
+    printf("%-20s %12zu failed: every sample was left out\n", name, size);
+    repeat_test_print_confidence();
+    any_failed = true;
+    return;
+  }
+
+  uint64_t best_time = global_rt.best_time;
+  double cycles_per_unit = (double)best_time / count;
+
+  const char * confidence =
+    repeat_test_confidence_name(repeat_test_confidence());
+
+  fprintf(output_file, "%s,%zu,%.4f,%s,%zu,%llu,%llu,", name, size,
+    cycles_per_unit, unit, count, (unsigned long long)best_time,
+    (unsigned long long)tsc_to_us(best_time));
+  if (0 == strcmp(unit, "byte"))
+  {
+    fprintf(output_file, "%.2f", calculate_gib_per_s(count, best_time));
+  }
+  fprintf(output_file, ",%s\n", confidence);
+  fflush(output_file);
+
+  printf("%-20s %12zu %10.4f cycles/%s", name, size, cycles_per_unit, unit);
+  if (0 == strcmp(unit, "byte"))
+  {
+    printf(" %8.2f GiB/s", calculate_gib_per_s(count, best_time));
+  }
+  BenchResult * previous = find_previous_result(name, size);
+  if (previous)
+  {
+    printf(" %+6.1f%%",
+      100 * (cycles_per_unit - previous->cycles_per_unit) / previous->cycles_per_unit);
+  }
+  printf(" [%s]\n", confidence);
+  if (repeat_test_stable) { repeat_test_print_confidence(); }
+}
+
+//// Main code /////////////////////////////////////////////////////////////////
+
+static uint8_t * allocate_buffer(size_t size)
+{
+#ifdef _WIN32
+  return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  void * p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static bool name_selected(const char * name, char ** names, size_t name_count)
+{
+  if (name_count == 0) { return true; }
+  for (size_t i = 0; i < name_count; i++)
+  {
+    if (0 == strncmp(name, names[i], strlen(names[i]))) { return true; }
+  }
+  return false;
+}
+
+int main(int argc, char ** argv)
+{
+  bool list = false;
+  int cpu = -1;
+  size_t max_size = GiB(1);
+  const char * output_filename = "bench_results.csv";
+  const char * compare_filename = NULL;
+  char ** names = malloc(argc * sizeof(char *));
+  size_t name_count = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char * arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (0 == strcmp(arg, "--list")) { list = true; }
+    else if (0 == strcmp(arg, "--seconds") && has_value)
+    {
+      repeat_test_timeout_us = strtod(argv[++i], NULL) * 1000000;
+    }
+    else if (0 == strcmp(arg, "--cpu") && has_value) { cpu = atoi(argv[++i]); }
+    else if (0 == strcmp(arg, "--stable")) { repeat_test_stable = true; }
+    else if (0 == strcmp(arg, "--max-size") && has_value)
+    {
+      max_size = strtoull(argv[++i], NULL, 0);
+    }
+    else if (0 == strcmp(arg, "--prefetch") && has_value)
+    {
+      prefetch_distance = strtoull(argv[++i], NULL, 0);
+    }
+    else if (0 == strcmp(arg, "--output") && has_value) { output_filename = argv[++i]; }
+    else if (0 == strcmp(arg, "--compare") && has_value) { compare_filename = argv[++i]; }
+    else if (arg[0] == '-')
+    {
+      fprintf(stderr, "Unknown option: %s\n", arg);
+      return 1;
+    }
+    else { names[name_count++] = argv[i]; }
+  }
+
+  if (list)
+  {
+    for (Benchmark * b = benchmarks; b->name; b++) { printf("%s\n", b->name); }
+    for (LoopVariant * v = loop_variants; v->name; v++) { printf("%s\n", v->name); }
+    return 0;
+  }
+
+  repeat_test_cpu = cpu;
+  if (cpu >= 0 && !pin_to_cpu(cpu))
+  {
+    fprintf(stderr, "Error: Cannot pin to CPU %d.\n", cpu);
+    return 1;
+  }
+
+  if (compare_filename) { load_previous_results(compare_filename); }
+
+  output_file = fopen(output_filename, "w");
+  if (output_file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot open %s.\n", output_filename);
+    return 1;
+  }
+  fprintf(output_file, "name,size,cycles_per_unit,unit,count,best_cycles,"
+    "best_us,gib_per_s,confidence\n");
+
+  uint8_t * data = allocate_buffer(max_size);
+  if (data == NULL)
+  {
+    fprintf(stderr, "Error: Cannot allocate %zu bytes.\n", max_size);
+    return 1;
+  }
+  memset(data, 1, max_size);
+
+  repeat_test_init();
+  printf("tsc_frequency: %llu\n", (unsigned long long)tsc_frequency);
+
+  for (Benchmark * b = benchmarks; b->name; b++)
+  {
+    if (!name_selected(b->name, names, name_count)) { continue; }
+    if (!cpu_supports(b->feature))
+    {
+      printf("%-20s skipped, needs %s\n", b->name, b->feature);
+      continue;
+    }
+    for (size_t size = b->min_size; size <= b->max_size && size <= max_size;
+      size <<= 2)
+    {
+      if (b->setup) { b->setup(size, data); }
+      size_t count = 0;
+      repeat_test_init();
+      while (repeat_test_continue())
+      {
+        repeat_test_sample_start();
+        count = b->run(size, data);
+        repeat_test_sample_end();
+      }
+      report(b->name, size, b->unit, count);
+    }
+  }
+
+  for (LoopVariant * v = loop_variants; v->name; v++)
+  {
+    if (!name_selected(v->name, names, name_count)) { continue; }
+    uint64_t iterations = loop_instructions_per_sample / (v->body + 3);
+    if (iterations < 256) { iterations = 256; }
+    repeat_test_init();
+    while (repeat_test_continue())
+    {
+      repeat_test_sample_start();
+      v->func(iterations);
+      repeat_test_sample_end();
+    }
+    report(v->name, 0, "iteration", iterations);
+  }
+
+  fclose(output_file);
+  return any_failed ? 1 : 0;
+}
@@ -1,20 +1,88 @@
 #!/usr/bin/bash -ue
 
-gcc -g -O2 -Wall store_latency.c -o store_latency
+# Builds the programs in this directory for the host: win64 objects under
+# MSYS2 on Windows, elf64 objects elsewhere.  The assembly kernels use the
+# WIN64_ARGS macro from abi.inc to work with either calling convention.
+#
+# Usage: ./build.sh [target...]
+#
+# With no targets, this builds bench, the benchmark runner.  The testers
+# marked "Windows only" call Windows APIs directly.
 
-#nasm -f win64 cache_tester.asm -o cache_tester.obj
-#gcc -g -Og -Wall cache_tester.c cache_tester.obj -o cache_tester
+if [ "${OS:-}" = Windows_NT ]; then
+  nasm_format=win64
+else
+  nasm_format=elf64
+fi
 
-#nasm -f win64 rw_port_tester.asm -o rw_port_tester.obj
-#gcc -g -Og -Wall rw_port_tester.c rw_port_tester.obj -o rw_port_tester
+asm() {
+  nasm -f $nasm_format "$1.asm" -o "$1.o"
+}
 
-# nasm -f win64 write_bytes.asm -o write_bytes.obj
-# gcc -g -Og -Wall repeat_write_bytes.c write_bytes.obj -o repeat_write_bytes
+build() {
+  case "$1" in
+  bench)
+    ruby gen_loop_variants.rb --offsets 0,16,32,48
+    asm cache_tester
+    asm rw_port_tester
+    asm write_bytes
+    asm pointer_chase
+    asm store_tester
+    asm loop_variants
+    gcc -g -O2 -Wall bench.c cache_tester.o rw_port_tester.o write_bytes.o \
+      pointer_chase.o store_tester.o loop_variants.o -o bench
+    ;;
+  cache_tester)
+    asm cache_tester
+    gcc -g -Og -Wall cache_tester.c cache_tester.o -o cache_tester
+    ;;
+  rw_port_tester)
+    asm rw_port_tester
+    gcc -g -Og -Wall rw_port_tester.c rw_port_tester.o -o rw_port_tester
+    ;;
+  repeat_write_bytes)
+    asm write_bytes
+    gcc -g -Og -Wall repeat_write_bytes.c write_bytes.o -o repeat_write_bytes
+    ;;
+  loop_alignment)
+    ruby gen_loop_variants.rb --offsets 0,16,32,48 --nop-sizes 1,5
+    asm loop_variants
+    gcc -g -Og -Wall loop_alignment.c loop_variants.o -o loop_alignment
+    ;;
+  haversine_sum)
+    gcc -g -Wall haversine_sum.c -pthread -lm -o haversine_sum
+    gcc -g -Wall haversine_sum.c -DPROFILE -pthread -lm -o haversine_sum_p
+    gcc -g -Wall haversine_sum.c -DPROFILE -DPROFILE_ALLOCATIONS -pthread -lm \
+      -o haversine_sum_pa
+    ;;
+  json_test)
+    gcc -g -Wall json_test.c -lm -o json_test && ./json_test
+    ;;
+  haversine_gen)
+    gcc -g -O2 -Wall haversine_gen.c -pthread -lm -o haversine_gen
+    ;;
+  bandwidth_tester)  # Windows only
+    asm cache_tester
+    gcc -g -O2 -Wall bandwidth_tester.c cache_tester.o -o bandwidth_tester
+    ;;
+  latency_tester)  # Windows only
+    asm pointer_chase
+    gcc -g -Og -Wall latency_tester.c pointer_chase.o -o latency_tester
+    ;;
+  store_tester)  # Windows only
+    asm store_tester
+    gcc -g -Og -Wall store_tester.c store_tester.o -o store_tester
+    ;;
+  store_latency)  # Windows only
+    gcc -g -O2 -Wall store_latency.c -o store_latency
+    ;;
+  *)
+    echo "Unknown target: $1" >&2
+    exit 1
+    ;;
+  esac
+}
 
-# gcc -g -Wall haversine_sum.c -o haversine_sum
-# gcc -g -Wall haversine_sum.c -DPROFILE -o haversine_sum_p
-
-#echo No profiler
-#./haversine_sum
-#echo
-#./haversine_sum_p
+for target in "${@:-bench}"; do
+  build "$target"
+done
@@ -5,6 +5,8 @@
 
 global read_loop
 
+%include "abi.inc"
+
 section .text
 
 ; rcx = arg 0 = data_length
@@ -14,6 +16,8 @@ section .text
 ; r10 = temporary pointer
 align 64
 read_loop:
+  WIN64_ARGS
+align 64
   mov r9, 0
 loop:
   mov r10, r9
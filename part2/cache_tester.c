@@ -42,7 +42,7 @@ static inline void perform_repeat_test(
 int main()
 {
   repeat_test_init();
-  printf("tsc_frequency: %llu\n", tsc_frequency);
+  printf("tsc_frequency: %llu\n", (unsigned long long)tsc_frequency);
 
   // TODO: use VirtualAlloc so it's aligned nicely
   void * data = malloc(data_size);
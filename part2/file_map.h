@@ -0,0 +1,74 @@
+// Read-only memory mapping of a whole file, for Windows and Linux.
+//
+// This file is released into the public domain.
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef struct FileMap
+{
+  const uint8_t * data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} FileMap;
+
+// Returns false if the file can't be opened or mapped.  An empty file
+// succeeds with data set to NULL.
+bool file_map_open(FileMap * map, const char * filename)
+{
+  *map = (FileMap){ 0 };
+#ifdef _WIN32
+  map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (map->file == INVALID_HANDLE_VALUE) { return false; }
+  LARGE_INTEGER size;
+  GetFileSizeEx(map->file, &size);
+  map->size = size.QuadPart;
+  if (map->size == 0) { return true; }
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map->mapping) { map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0); }
+  if (map->data == NULL)
+  {
+    if (map->mapping) { CloseHandle(map->mapping); }
+    CloseHandle(map->file);
+    return false;
+  }
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) { return false; }
+  struct stat st;
+  fstat(fd, &st);
+  map->size = st.st_size;
+  if (map->size)
+  {
+    void * p = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    map->data = p == MAP_FAILED ? NULL : p;
+  }
+  close(fd);
+  if (map->size && map->data == NULL) { return false; }
+#endif
+  return true;
+}
+
+void file_map_close(FileMap * map)
+{
+#ifdef _WIN32
+  if (map->data) { UnmapViewOfFile(map->data); }
+  if (map->mapping) { CloseHandle(map->mapping); }
+  CloseHandle(map->file);
+#else
+  if (map->data) { munmap((void *)map->data, map->size); }
+#endif
+  *map = (FileMap){ 0 };
+}
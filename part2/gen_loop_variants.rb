@@ -0,0 +1,112 @@
+#!/usr/bin/env ruby
+
+# Generates loop_variants.asm and loop_variants.h for loop_alignment.c.
+#
+# Each variant is the loop from write_bytes.asm with a body of nops in front
+# of the loop counter.  The variants differ in:
+# - offset: where the top of the loop lands relative to a 64-byte boundary.
+#   The padding that puts it there is jumped over, so it never runs.
+# - body: how many nops are in the loop body.  The default list steps across
+#   the sizes where a loop stops fitting in the loop stream detector (~64
+#   uops) and in the decoded uop cache (~1.5K-4K uops).
+# - nop size: how many bytes each nop takes (1 to 9), which lets us change
+#   the loop's size in bytes without changing its uop count.
+
+require 'optparse'
+
+# Recommended multi-byte nop encodings from the Intel optimization manual.
+Nops = [
+  nil,
+  [0x90],
+  [0x66, 0x90],
+  [0x0F, 0x1F, 0x00],
+  [0x0F, 0x1F, 0x40, 0x00],
+  [0x0F, 0x1F, 0x44, 0x00, 0x00],
+  [0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00],
+  [0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00],
+  [0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00],
+  [0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00],
+]
+
+offsets = (0...64).step(8).to_a
+bodies = [0, 4, 8, 16, 32, 48, 56, 64, 72, 96, 128, 256, 512, 1024, 1536,
+  2048, 3072, 4096]
+nop_sizes = [1]
+
+OptionParser.new do |opts|
+  opts.banner = 'Usage: gen_loop_variants.rb [options]'
+  opts.on('--offsets LIST', Array, 'Loop start offsets mod 64') do |list|
+    offsets = list.map(&:to_i)
+  end
+  opts.on('--bodies LIST', Array, 'Number of nops in the loop body') do |list|
+    bodies = list.map(&:to_i)
+  end
+  opts.on('--nop-sizes LIST', Array, 'Bytes per nop (1-9)') do |list|
+    nop_sizes = list.map(&:to_i)
+  end
+end.parse!
+
+variants = []
+nop_sizes.each do |nop_size|
+  Nops.fetch(nop_size) or raise ArgumentError, "Invalid nop size #{nop_size}"
+  bodies.each do |body|
+    offsets.each do |offset|
+      raise ArgumentError, "Invalid offset #{offset}" if !(0...64).include?(offset)
+      name = "loop_n#{nop_size}_b#{body}_o#{offset}"
+      variants << { name: name, offset: offset, body: body, nop_size: nop_size }
+    end
+  end
+end
+
+File.open('loop_variants.asm', 'w') do |f|
+  f.puts '; Generated by gen_loop_variants.rb.  Do not edit.'
+  f.puts
+  f.puts '%include "abi.inc"'
+  f.puts
+  f.puts 'section .text'
+  variants.each do |v|
+    f.puts
+    f.puts "global #{v[:name]}"
+    f.puts 'align 64'
+    f.puts "#{v[:name]}:"
+    f.puts '  WIN64_ARGS'
+    f.puts '  xor eax, eax'
+    f.puts '  jmp .loop'
+    f.puts 'align 64'
+    f.puts "  times #{v[:offset]} db 0x90" if v[:offset] > 0
+    f.puts '.loop:'
+    if v[:body] > 0
+      f.puts "  times #{v[:body]} db " + Nops[v[:nop_size]].map { |b| '0x%02X' % b }.join(', ')
+    end
+    f.puts '  inc rax'
+    f.puts '  cmp rax, rcx'
+    f.puts '  jb .loop'
+    f.puts '  ret'
+  end
+end
+
+File.open('loop_variants.h', 'w') do |f|
+  f.puts '// Generated by gen_loop_variants.rb.  Do not edit.'
+  f.puts
+  f.puts 'typedef struct LoopVariant'
+  f.puts '{'
+  f.puts '  const char * name;'
+  f.puts '  void (*func)(uint64_t iterations);'
+  f.puts '  unsigned int offset;'
+  f.puts '  unsigned int body;'
+  f.puts '  unsigned int nop_size;'
+  f.puts '} LoopVariant;'
+  f.puts
+  variants.each do |v|
+    f.puts "void #{v[:name]}(uint64_t iterations);"
+  end
+  f.puts
+  f.puts 'LoopVariant loop_variants[] = {'
+  variants.each do |v|
+    f.puts "  { \"#{v[:name]}\", #{v[:name]}, #{v[:offset]}, #{v[:body]}, #{v[:nop_size]} },"
+  end
+  f.puts '  { NULL },'
+  f.puts '};'
+end
+
+puts "Generated #{variants.size} loop variants."
@@ -0,0 +1,518 @@
+// Generates points.json and haversine.f64 in the same format as
+// haversine_gen.rb, but fast enough to make files with hundreds of millions
+// of pairs, and with more kinds of data.
+//
+// Usage: haversine_gen [options] [count [extra_field_count]]
+//
+// The arguments mean the same as for haversine_gen.rb.  Options:
+//   --seed N          Seed for the random numbers (default 1).  The output
+//                     only depends on the seed and the options, not on the
+//                     number of threads.
+//   --threads N       Number of threads (default: one per processor).
+//   --distribution D  How the points are spread out:
+//                     uniform:     all over the globe, like haversine_gen.rb
+//                                  (the default).
+//                     cluster:     in clusters of different sizes and
+//                                  popularity, like real location data.
+//                     adversarial: edge cases, like identical points,
+//                                  antipodes, poles, the date line, and
+//                                  tiny values.
+//   --format F        How the numbers are written:
+//                     shortest: the shortest text that reads back as the
+//                               same double, like Ruby (the default).
+//                     digits:   a random number of significant digits.
+//                     exponent: exponent notation with random digits.
+//                     mixed:    a random one of the above for each number.
+//
+// The expected distances in haversine.f64 are computed from the numbers as
+// written, so they stay right when the format rounds them.
+//
+// This file is released into the public domain.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread.h"
+
+#define EARTH_RADIUS 6372.8
+
+// Each chunk of pairs gets its own random number sequence, so chunks can be
+// generated on any thread in any order.  Don't change this, or the files
+// made with a given seed will change.
+#define CHUNK_PAIRS 16384
+
+#define CLUSTER_COUNT 64
+
+typedef enum Distribution
+{
+  DistributionUniform,
+  DistributionCluster,
+  DistributionAdversarial,
+} Distribution;
+
+typedef enum NumberFormat
+{
+  FormatShortest,
+  FormatDigits,
+  FormatExponent,
+  FormatMixed,
+} NumberFormat;
+
+uint64_t seed = 1;
+uint64_t pair_count = 1000000;
+unsigned int extra_field_count;
+Distribution distribution = DistributionUniform;
+NumberFormat number_format = FormatShortest;
+
+//// Random numbers ////////////////////////////////////////////////////////////
+
+// SplitMix64: fast, and any 64-bit state is a good starting point.
+typedef struct Random
+{
+  uint64_t state;
+} Random;
+
+static uint64_t random_u64(Random * r)
+{
+  uint64_t z = (r->state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+static Random random_for_chunk(uint64_t chunk)
+{
+  Random r = { seed };
+  r.state = random_u64(&r) ^ chunk * 0xD1B54A32D192ED03;
+  return r;
+}
+
+// Uniform in [0, 1).
+static double random_unit(Random * r)
+{
+  return (random_u64(r) >> 11) * 0x1p-53;
+}
+
+static double random_range(Random * r, double min, double max)
+{
+  return min + (max - min) * random_unit(r);
+}
+
+static unsigned int random_below(Random * r, unsigned int n)
+{
+  return (random_u64(r) >> 32) * n >> 32;
+}
+
+// Standard normal distribution, by the Box-Muller transform.
+static double random_normal(Random * r)
+{
+  double u = 1.0 - random_unit(r);
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * random_unit(r));
+}
+
+//// Distributions /////////////////////////////////////////////////////////////
+
+typedef struct Pair
+{
+  double x0, y0, x1, y1;
+} Pair;
+
+struct
+{
+  double x, y;
+  double radius;  // standard deviation, in degrees
+} clusters[CLUSTER_COUNT];
+
+static void clusters_init()
+{
+  Random r = random_for_chunk(UINT64_MAX);
+  for (int i = 0; i < CLUSTER_COUNT; i++)
+  {
+    clusters[i].x = random_range(&r, -180.0, 180.0);
+    clusters[i].y = random_range(&r, -70.0, 70.0);
+    clusters[i].radius = exp(random_range(&r, log(0.01), log(20.0)));
+  }
+}
+
+static double wrap_longitude(double x)
+{
+  while (x >= 180.0) { x -= 360.0; }
+  while (x < -180.0) { x += 360.0; }
+  return x;
+}
+
+static double fold_latitude(double y)
+{
+  if (y > 90.0) { y = 180.0 - y; }
+  if (y < -90.0) { y = -180.0 - y; }
+  return fmax(-90.0, fmin(90.0, y));
+}
+
+static void cluster_point(Random * r, int cluster, double * x, double * y)
+{
+  double radius = clusters[cluster].radius;
+  *x = wrap_longitude(clusters[cluster].x + radius * random_normal(r));
+  *y = fold_latitude(clusters[cluster].y + radius * random_normal(r));
+}
+
+static void uniform_pair(Random * r, Pair * pair)
+{
+  pair->x0 = random_range(r, -180.0, 180.0);
+  pair->y0 = random_range(r, -90.0, 90.0);
+  pair->x1 = random_range(r, -180.0, 180.0);
+  pair->y1 = random_range(r, -90.0, 90.0);
+}
+
+// Most pairs stay within one cluster, and some clusters are much more
+// popular than others.
+static void cluster_pair(Random * r, Pair * pair)
+{
+  double u = random_unit(r);
+  int cluster0 = (int)(u * u * CLUSTER_COUNT);
+  int cluster1 = cluster0;
+  if (random_unit(r) < 0.2) { cluster1 = random_below(r, CLUSTER_COUNT); }
+  cluster_point(r, cluster0, &pair->x0, &pair->y0);
+  cluster_point(r, cluster1, &pair->x1, &pair->y1);
+}
+
+static void adversarial_pair(Random * r, Pair * pair)
+{
+  double tiny = random_normal(r) * 1e-9;
+  uniform_pair(r, pair);
+  switch (random_below(r, 6))
+  {
+    case 0:  // the same point twice
+      pair->x1 = pair->x0;
+      pair->y1 = pair->y0;
+      break;
+    case 1:  // almost antipodal, where asin is close to 1
+      pair->x1 = wrap_longitude(pair->x0 + 180.0 + tiny);
+      pair->y1 = fold_latitude(-pair->y0 + tiny);
+      break;
+    case 2:  // at or next to the poles
+      pair->y0 = random_unit(r) < 0.5 ? 90.0 : -90.0;
+      pair->y1 = fold_latitude(copysign(90.0, pair->y0) - fabs(tiny));
+      break;
+    case 3:  // across the date line
+      pair->x0 = 180.0 - fabs(tiny);
+      pair->x1 = -180.0 + fabs(tiny);
+      break;
+    case 4:  // tiny values, with many leading zeros
+    {
+      double scale = pow(10.0, -(double)(1 + random_below(r, 12)));
+      pair->x0 *= scale;
+      pair->y0 *= scale;
+      pair->x1 *= scale;
+      pair->y1 *= scale;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+//// Number formats ////////////////////////////////////////////////////////////
+
+// Writes what Ruby's Float#to_s writes: the shortest digits that read back
+// as the same double, with at least one digit after the point.
+static int format_shortest(char * out, double value)
+{
+  // 17 digits always read back the same, and most random doubles need 16
+  // or 17, so try 16 first and only try 15 if 16 is enough.
+  int length = sprintf(out, "%.16g", value);
+  if (strtod(out, NULL) == value)
+  {
+    char shorter[32];
+    int shorter_length = sprintf(shorter, "%.15g", value);
+    if (strtod(shorter, NULL) == value)
+    {
+      memcpy(out, shorter, shorter_length + 1);
+      length = shorter_length;
+    }
+  }
+  else
+  {
+    length = sprintf(out, "%.17g", value);
+  }
+
+  char * end = strchr(out, 'e');
+  if (end == NULL) { end = out + length; }
+  if (memchr(out, '.', end - out) == NULL)
+  {
+    memmove(end + 2, end, out + length - end + 1);
+    memcpy(end, ".0", 2);
+    length += 2;
+  }
+  return length;
+}
+
+// The parser doesn't take a '+' in exponents, so write e+05 as e5 and e-05
+// as e-5.
+static int trim_exponent(char * out, int length)
+{
+  char * e = strchr(out, 'e');
+  if (e == NULL) { return length; }
+  char * from = e + 1;
+  char * to = e + 1;
+  if (*from == '+') { from++; }
+  else if (*from == '-') { *to++ = *from++; }
+  while (from[0] == '0' && from[1]) { from++; }
+  memmove(to, from, out + length - from + 1);
+  return length - (from - to);
+}
+
+// Writes 'value' in the given format, and changes it to the value that the
+// text reads back as.
+static int format_number(char * out, double * value, NumberFormat format,
+  Random * r)
+{
+  if (format == FormatMixed) { format = random_below(r, 3); }
+  int length;
+  switch (format)
+  {
+    case FormatDigits:
+      length = sprintf(out, "%.*g", 1 + random_below(r, 17), *value);
+      length = trim_exponent(out, length);
+      break;
+    case FormatExponent:
+      length = sprintf(out, "%.*e", random_below(r, 17), *value);
+      length = trim_exponent(out, length);
+      break;
+    default:
+      return format_shortest(out, *value);
+  }
+  *value = strtod(out, NULL);
+  return length;
+}
+
+//// Generation ////////////////////////////////////////////////////////////////
+
+// Same as haversine_distance in haversine_gen.rb, operation for operation,
+// except for the clamp on 'a', which haversine_sum.c has too.
+static double haversine_distance(Pair * pair)
+{
+  double lat1 = pair->y0;
+  double lat2 = pair->y1;
+  double lon1 = pair->x0;
+  double lon2 = pair->x1;
+  double d_lat = 0.01745329251994329577 * (lat2 - lat1);
+  double d_lon = 0.01745329251994329577 * (lon2 - lon1);
+  lat1 = 0.01745329251994329577 * lat1;
+  lat2 = 0.01745329251994329577 * lat2;
+
+  double s_lat = sin(d_lat / 2.0);
+  double s_lon = sin(d_lon / 2);
+  double a = s_lat * s_lat + cos(lat1) * cos(lat2) * (s_lon * s_lon);
+
+  // Rounding can put 'a' just over 1 for antipodal points, where Ruby's
+  // Math.asin would raise and asin returns NaN.
+  if (a > 1.0) { a = 1.0; }
+  double c = 2.0 * asin(sqrt(a));
+
+  return EARTH_RADIUS * c;
+}
+
+static char * append(char * out, const char * text)
+{
+  size_t length = strlen(text);
+  memcpy(out, text, length);
+  return out + length;
+}
+
+typedef struct Chunk
+{
+  Thread thread;
+  uint64_t index;
+  size_t pair_count;
+  char * text;
+  size_t text_size;
+  double * distances;
+} Chunk;
+
+// The most text one pair can take: 4 + extra_field_count fields of up to
+// 12 bytes of name and 25 of number, plus the braces and indent.
+static size_t max_pair_text_size()
+{
+  return 8 + (4 + extra_field_count) * 40;
+}
+
+static void generate_chunk(void * arg)
+{
+  Chunk * chunk = arg;
+  Random r = random_for_chunk(chunk->index);
+  char * out = chunk->text;
+  for (size_t i = 0; i < chunk->pair_count; i++)
+  {
+    Pair pair;
+    switch (distribution)
+    {
+      case DistributionCluster: cluster_pair(&r, &pair); break;
+      case DistributionAdversarial: adversarial_pair(&r, &pair); break;
+      default: uniform_pair(&r, &pair); break;
+    }
+
+    out = append(out, "  {\"x0\":");
+    out += format_number(out, &pair.x0, number_format, &r);
+    out = append(out, ",\"y0\":");
+    out += format_number(out, &pair.y0, number_format, &r);
+    out = append(out, ",\"x1\":");
+    out += format_number(out, &pair.x1, number_format, &r);
+    out = append(out, ",\"y1\":");
+    out += format_number(out, &pair.y1, number_format, &r);
+    for (unsigned int f = 0; f < extra_field_count; f++)
+    {
+      double extra = random_range(&r, -1000.0, 1000.0);
+      out += sprintf(out, ",\"extra%u\":", f);
+      out += format_number(out, &extra, number_format, &r);
+    }
+    out = append(out, "},\n");
+
+    chunk->distances[i] = haversine_distance(&pair);
+  }
+  chunk->text_size = out - chunk->text;
+}
+
+static bool parse_option(const char * name, const char * value,
+  const char * const * choices, int * result)
+{
+  for (int i = 0; choices[i]; i++)
+  {
+    if (0 == strcmp(value, choices[i]))
+    {
+      *result = i;
+      return true;
+    }
+  }
+  fprintf(stderr, "Error: Unknown %s: %s\n", name, value);
+  return false;
+}
+
+int main(int argc, char ** argv)
+{
+  static const char * const distributions[] =
+    { "uniform", "cluster", "adversarial", NULL };
+  static const char * const formats[] =
+    { "shortest", "digits", "exponent", "mixed", NULL };
+
+  size_t thread_count = thread_cpu_count();
+  int arg_count = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    int choice;
+    if (0 == strcmp(argv[i], "--seed") && i + 1 < argc)
+    {
+      seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc)
+    {
+      thread_count = strtoul(argv[++i], NULL, 10);
+      if (thread_count == 0) { thread_count = 1; }
+    }
+    else if (0 == strcmp(argv[i], "--distribution") && i + 1 < argc)
+    {
+      if (!parse_option("distribution", argv[++i], distributions, &choice))
+      {
+        return 1;
+      }
+      distribution = choice;
+    }
+    else if (0 == strcmp(argv[i], "--format") && i + 1 < argc)
+    {
+      if (!parse_option("format", argv[++i], formats, &choice)) { return 1; }
+      number_format = choice;
+    }
+    else if (arg_count == 0)
+    {
+      pair_count = strtoull(argv[i], NULL, 10);
+      arg_count++;
+    }
+    else if (arg_count == 1)
+    {
+      extra_field_count = strtoul(argv[i], NULL, 10);
+      arg_count++;
+    }
+    else
+    {
+      fprintf(stderr, "Error: Unexpected argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE * point_file = fopen("points.json", "wb");
+  FILE * answer_file = fopen("haversine.f64", "wb");
+  if (point_file == NULL || answer_file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot open output files.\n");
+    return 1;
+  }
+
+  clusters_init();
+
+  // We generate one round of chunks, one per thread, while we write out the
+  // round before it, so there are two sets of chunks.
+  Chunk * chunks = calloc(2 * thread_count, sizeof(Chunk));
+  for (size_t i = 0; i < 2 * thread_count; i++)
+  {
+    chunks[i].text = malloc(CHUNK_PAIRS * max_pair_text_size());
+    chunks[i].distances = malloc(CHUNK_PAIRS * sizeof(double));
+  }
+
+  fputs("{ \"pairs\": [\n", point_file);
+  double total = 0;
+  uint64_t chunk_count = (pair_count + CHUNK_PAIRS - 1) / CHUNK_PAIRS;
+  uint64_t round_count = (chunk_count + thread_count - 1) / thread_count;
+  for (uint64_t round = 0; round <= round_count; round++)
+  {
+    Chunk * generating = chunks + (round % 2) * thread_count;
+    Chunk * writing = chunks + ((round + 1) % 2) * thread_count;
+    size_t started = 0;
+    for (; round < round_count && started < thread_count; started++)
+    {
+      Chunk * chunk = &generating[started];
+      chunk->index = round * thread_count + started;
+      if (chunk->index >= chunk_count) { break; }
+      uint64_t first_pair = chunk->index * CHUNK_PAIRS;
+      chunk->pair_count = pair_count - first_pair < CHUNK_PAIRS ?
+        pair_count - first_pair : CHUNK_PAIRS;
+      thread_start(&chunk->thread, generate_chunk, chunk);
+    }
+
+    // Write in order, and add up the distances in order, so the average
+    // doesn't depend on the number of threads either.
+    for (size_t i = 0; round > 0 && i < thread_count; i++)
+    {
+      Chunk * chunk = &writing[i];
+      if (chunk->pair_count == 0) { break; }
+      fwrite(chunk->text, 1, chunk->text_size, point_file);
+      fwrite(chunk->distances, sizeof(double), chunk->pair_count, answer_file);
+      for (size_t j = 0; j < chunk->pair_count; j++)
+      {
+        total += chunk->distances[j];
+      }
+      chunk->pair_count = 0;
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+      thread_join(&generating[i].thread);
+    }
+  }
+  fputs("]}\n", point_file);
+
+  double average = total / pair_count;
+  fwrite(&average, sizeof(double), 1, answer_file);
+  if (fclose(point_file) || fclose(answer_file))
+  {
+    fprintf(stderr, "Error: Cannot write output files.\n");
+    return 1;
+  }
+
+  char text[32];
+  format_shortest(text, average);
+  printf("Average: %s\n", text);
+  return 0;
+}
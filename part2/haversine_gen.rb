@@ -31,6 +31,10 @@ end
 
 count = ARGV.fetch(0, 1000000).to_i
 
+# Extra fields in each pair that haversine_sum doesn't use, to make the file
+# look more like our real records.
+extra_field_count = ARGV.fetch(1, 0).to_i
+
 point_file = File.open('points.json', 'w')
 answer_file = File.open('haversine.f64', 'wb')
 
@@ -41,6 +45,9 @@ count.times do |n|
     x0: rand(-180.0...180.0), y0: rand(-90.0...90.0),
     x1: rand(-180.0...180.0), y1: rand(-90.0...90.0),
   }
+  extra_field_count.times do |i|
+    pair[:"extra#{i}"] = rand(-1000.0...1000.0)
+  end
   point_file.puts '  ' + JSON.dump(pair) + ','
   distance = haversine_distance(pair)
   answer_file.write([distance].pack('d'))
@@ -5,12 +5,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include <windows.h>
-#include <profileapi.h>
+#include <sys/stat.h>
 
 #include "profile.h"
 #include "json.h"
+#include "pair_cache.h"
+#include "thread.h"
+
+#ifndef _WIN32
+#include <glob.h>
+#endif
 
 static double square(double x)
 {
@@ -38,21 +42,110 @@ static double haversine_distance(double x0, double y0, double x1, double y1)
 
   double a = square(sin(d_lat / 2.0)) + \
     cos(lat1) * cos(lat2) * square(sin(d_lon / 2));
+
+  // Rounding can put 'a' just over 1 for antipodal points, where asin
+  // returns NaN.  haversine_gen.c clamps it the same way.
+  if (a > 1.0) { a = 1.0; }
   double c = 2.0*asin(sqrt(a));
 
   return earth_radius * c;
 }
 
-int main()
+//// Verify mode ///////////////////////////////////////////////////////////////
+
+// Compares the distances we compute with the ones haversine_gen.rb wrote to
+// haversine.f64: one double per pair, followed by the average.
+struct
 {
-  profile_init();
+  FileMap map;
+  const double * expected;  // NULL unless we're verifying
+  size_t expected_count;
 
-  FILE * file = fopen("points.json", "r");
-  profile_block("JSON parse");
-  Json * data = json_parse_file(file);
+  size_t checked_count;
+  size_t extra_count;       // pairs that aren't in the answer file
+  size_t nan_count;         // pairs where we or the answer file got NaN
+  double total_error;
+  double max_error;
+  size_t worst_index;
+  double worst_distance;
+} verifier;
 
-  profile_block_done();
+static bool verify_open(const char * filename)
+{
+  if (!file_map_open(&verifier.map, filename) ||
+    verifier.map.size < sizeof(double) || verifier.map.size % sizeof(double))
+  {
+    fprintf(stderr, "Error: Cannot read answers from %s.\n", filename);
+    return false;
+  }
+  verifier.expected = (const double *)verifier.map.data;
+  verifier.expected_count = verifier.map.size / sizeof(double) - 1;
+  return true;
+}
+
+// Called for every distance, so it only does a few operations, and the
+// branch is always predicted right when we're not verifying.
+static inline void verify_distance(size_t index, double distance)
+{
+  if (verifier.expected == NULL) { return; }
+  if (index >= verifier.expected_count)
+  {
+    verifier.extra_count++;
+    return;
+  }
+  double error = fabs(distance - verifier.expected[index]);
+  verifier.total_error += error;
+  verifier.checked_count++;
+
+  // A NaN is worse than any error, so the first one becomes the worst pair
+  // and stays there.  (Comparisons with NaN are always false.)
+  if (isnan(error)) { verifier.nan_count++; }
+  if ((!(error <= verifier.max_error) && !isnan(verifier.max_error)) ||
+    verifier.checked_count == 1)
+  {
+    verifier.max_error = error;
+    verifier.worst_index = index;
+    verifier.worst_distance = distance;
+  }
+}
+
+// Prints the report and returns false if the number of pairs doesn't match
+// or a distance was NaN.
+// 'partial' means we only saw some of the pairs, as in follow mode.
+static bool verify_print_report(double average, bool partial)
+{
+  if (verifier.expected == NULL) { return true; }
+  double expected_average = verifier.expected[verifier.expected_count];
+  printf("Verify: checked %llu of %llu pairs\n",
+    (unsigned long long)verifier.checked_count,
+    (unsigned long long)verifier.expected_count);
+  if (verifier.extra_count)
+  {
+    printf("  %llu pairs not in the answer file\n",
+      (unsigned long long)verifier.extra_count);
+  }
+  if (verifier.nan_count)
+  {
+    printf("  NaN distances: %llu\n",
+      (unsigned long long)verifier.nan_count);
+  }
+  printf("  max error: %.6e at pair %llu (%.15f, expected %.15f)\n",
+    verifier.max_error, (unsigned long long)verifier.worst_index,
+    verifier.worst_distance, verifier.expected[verifier.worst_index]);
+  printf("  mean error: %.6e\n", verifier.checked_count ?
+    verifier.total_error / verifier.checked_count : 0.0);
+  printf("  average error: %.6e\n", fabs(average - expected_average));
+
+  bool match = verifier.extra_count == 0 && verifier.nan_count == 0 &&
+    (partial || verifier.checked_count == verifier.expected_count);
+  file_map_close(&verifier.map);
+  return match;
+}
 
+// Sums the distances of all the pairs in a parsed Json tree.
+// Returns false if the file doesn't have the expected structure.
+static bool sum_pairs_json(Json * data, double * sum, size_t * count)
+{
   profile_block("Look up pairs");
   Json * pairs = json_object_lookup(data, "pairs");
   profile_block_done();
@@ -60,35 +153,826 @@ int main()
   if (pairs == NULL)
   {
     fprintf(stderr, "Error: Cannot find 'pairs' in file.\n");
-    return 1;
+    return false;
   }
   if (pairs->type != JsonArray)
   {
     fprintf(stderr, "Error: 'pairs' is not an array.\n");
-    return 1;
+    return false;
   }
 
   profile_block("Average");
-  double sum = 0;
-  size_t count = 0;
   for (Json * pair = pairs->first; pair; pair = pair->next)
   {
-    double x0 = json_object_lookup(pair, "x0")->number;
-    double y0 = json_object_lookup(pair, "y0")->number;
-    double x1 = json_object_lookup(pair, "x1")->number;
-    double y1 = json_object_lookup(pair, "y1")->number;
+    double x0 = json_number(json_object_lookup(pair, "x0"));
+    double y0 = json_number(json_object_lookup(pair, "y0"));
+    double x1 = json_number(json_object_lookup(pair, "x1"));
+    double y1 = json_number(json_object_lookup(pair, "y1"));
     //printf("%20.15lf %20.15lf %20.15lf %20.15lf\n", x0, y0, x1, y1);
-    sum += haversine_distance(x0, y0, x1, y1);
-    count += 1;
+    double distance = haversine_distance(x0, y0, x1, y1);
+    verify_distance(*count, distance);
+    *sum += distance;
+    *count += 1;
   }
-  double average = sum / count;
-  profile_record_bytes(count * 4 * sizeof(double));
+  profile_record_bytes(*count * 4 * sizeof(double));
+  profile_block_done();
+  return true;
+}
+
+static bool sum_pairs_tree(FILE * file, bool lazy_numbers,
+  double * sum, size_t * count)
+{
+  profile_block("JSON parse");
+  Json * data = json_parse_file(file, lazy_numbers);
+  profile_block_done();
+
+  return sum_pairs_json(data, sum, count);
+}
+
+// Same as sum_pairs_tree, but using the flat JsonTape.
+static bool sum_pairs_tape(FILE * file, double * sum, size_t * count)
+{
+  profile_block("JSON parse");
+  JsonTape * tape = json_tape_parse_file(file);
+  profile_block_done();
+
+  profile_block("Look up pairs");
+  size_t pairs = json_tape_object_lookup(tape, 0, "pairs");
+  profile_block_done();
+
+  if (pairs == 0)
+  {
+    fprintf(stderr, "Error: Cannot find 'pairs' in file.\n");
+    return false;
+  }
+  if (tape->entries[pairs].type != JsonArray)
+  {
+    fprintf(stderr, "Error: 'pairs' is not an array.\n");
+    return false;
+  }
+
+  profile_block("Average");
+  JsonTapeEntry * e = tape->entries;
+  size_t end = e[pairs].end;
+  for (size_t pair = pairs + 1; pair < end; pair = json_tape_skip(tape, pair))
+  {
+    double x0 = e[json_tape_object_lookup(tape, pair, "x0")].number;
+    double y0 = e[json_tape_object_lookup(tape, pair, "y0")].number;
+    double x1 = e[json_tape_object_lookup(tape, pair, "x1")].number;
+    double y1 = e[json_tape_object_lookup(tape, pair, "y1")].number;
+    double distance = haversine_distance(x0, y0, x1, y1);
+    verify_distance(*count, distance);
+    *sum += distance;
+    *count += 1;
+  }
+  profile_record_bytes(*count * 4 * sizeof(double));
+  profile_block_done();
+  return true;
+}
+
+//// Record parser /////////////////////////////////////////////////////////////
+
+#define PAIR_FIELDS(X) X(x0) X(y0) X(x1) X(y1)
+JSON_RECORD(PairRecord, PAIR_FIELDS)
+
+// Sums the pairs in 'data' with PairRecord_parse, and uses the generic
+// parser for any pair it can't handle.  This finds the pairs by looking for
+// the first '[' after "pairs", so it doesn't check the rest of the document.
+static bool sum_pairs_records(const char * data, size_t size,
+  double * sum, size_t * count, size_t * fallback_count)
+{
+  const char * p = strstr(data, "\"pairs\"");
+  if (p) { p = strchr(p, '['); }
+  if (p == NULL)
+  {
+    fprintf(stderr, "Error: Cannot find a 'pairs' array in file.\n");
+    return false;
+  }
+  p++;
+
+  profile_block("Record parse");
+  while (true)
+  {
+    while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == ',')
+    {
+      p++;
+    }
+    if (*p == ']') { break; }
+    if (*p == 0)
+    {
+      fprintf(stderr, "Error: Unexpected end of file.\n");
+      return false;
+    }
+
+    PairRecord r;
+    if (!PairRecord_parse(&p, &r))
+    {
+      JsonInputBuffer buf = { .data = (char *)p, .size = size - (p - data) };
+      Json * pair = json_parse_core(&buf);
+      Json * c[4] = { NULL };
+      if (pair->type == JsonObject)
+      {
+        c[0] = json_object_lookup(pair, "x0");
+        c[1] = json_object_lookup(pair, "y0");
+        c[2] = json_object_lookup(pair, "x1");
+        c[3] = json_object_lookup(pair, "y1");
+      }
+      if (!c[0] || !c[1] || !c[2] || !c[3])
+      {
+        fprintf(stderr, "Error: Pair %llu is not a pair.\n",
+          (unsigned long long)*count);
+        return false;
+      }
+      r = (PairRecord){ json_number(c[0]), json_number(c[1]),
+        json_number(c[2]), json_number(c[3]) };
+      json_free(pair);
+      p += buf.index;
+      *fallback_count += 1;
+    }
+
+    double distance = haversine_distance(r.x0, r.y0, r.x1, r.y1);
+    verify_distance(*count, distance);
+    *sum += distance;
+    *count += 1;
+  }
+  profile_record_bytes(p - data);
+  profile_block_done();
+  return true;
+}
+
+// Reads the whole file and sums the pairs with sum_pairs_records, and
+// reports how fast that went.  If 'compare' is true, it also times the
+// generic parser on the same text.
+static bool sum_pairs_records_file(FILE * file, bool compare,
+  double * sum, size_t * count)
+{
+  if (tsc_frequency == 0) { measure_tsc_frequency(); }
+
+  profile_block("Read");
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char * data = calloc(size + 16, 1);  // PairRecord_parse can read ahead
+  size = fread(data, 1, size, file);
+  profile_record_bytes(size);
+  profile_block_done();
+
+  uint64_t generic_time = 0;
+  if (compare)
+  {
+    // Don't verify the same pairs twice.
+    const double * expected = verifier.expected;
+    verifier.expected = NULL;
+
+    uint64_t start_tsc = __rdtsc();
+    JsonInputBuffer buf = { .data = data, .size = size };
+    Json * json = json_parse_core(&buf);
+    double generic_sum = 0;
+    size_t generic_count = 0;
+    sum_pairs_json(json, &generic_sum, &generic_count);
+    json_free(json);
+    generic_time = __rdtsc() - start_tsc;
+    verifier.expected = expected;
+  }
+
+  uint64_t start_tsc = __rdtsc();
+  size_t fallback_count = 0;
+  bool success = sum_pairs_records(data, size, sum, count, &fallback_count);
+  uint64_t time = __rdtsc() - start_tsc;
+  free(data);
+  if (!success) { return false; }
+
+  double records_per_us = *count / (time * (double)tsc_units_in_us);
+  printf("Record parser: %.0f records/s (%llu generic fallbacks)\n",
+    records_per_us * 1e6, (unsigned long long)fallback_count);
+  if (compare)
+  {
+    double generic_per_us = *count / (generic_time * (double)tsc_units_in_us);
+    printf("Generic parser: %.0f records/s, %.2fx slower\n",
+      generic_per_us * 1e6, (double)generic_time / time);
+  }
+  return true;
+}
+
+//// Follow mode ///////////////////////////////////////////////////////////////
+
+// What we remember between runs in follow mode.
+typedef struct FollowState
+{
+  uint64_t offset;  // bytes of the file already processed
+  double sum;
+  uint64_t count;
+
+  // Which file the offset is in, so we start over if the file was replaced
+  // by a new one instead of appended to.  (On Windows, stat doesn't give
+  // inode numbers, so this only notices a file moving to another drive.)
+  uint64_t device;
+  uint64_t inode;
+} FollowState;
+
+static void follow_state_load(const char * filename, FollowState * state)
+{
+  *state = (FollowState){ 0 };
+  FILE * file = fopen(filename, "r");
+  if (file == NULL) { return; }
+  unsigned long long offset, count, device, inode;
+  if (5 == fscanf(file, "%llu %lf %llu %llu %llu", &offset, &state->sum,
+    &count, &device, &inode))
+  {
+    state->offset = offset;
+    state->count = count;
+    state->device = device;
+    state->inode = inode;
+  }
+  else
+  {
+    fprintf(stderr, "Warning: Cannot read %s, starting over.\n", filename);
+    *state = (FollowState){ 0 };
+  }
+  fclose(file);
+}
+
+static void follow_state_save(const char * filename, FollowState * state)
+{
+  FILE * file = fopen(filename, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot write %s.\n", filename);
+    return;
+  }
+  fprintf(file, "%llu %.17g %llu %llu %llu\n",
+    (unsigned long long)state->offset, state->sum,
+    (unsigned long long)state->count, (unsigned long long)state->device,
+    (unsigned long long)state->inode);
+  fclose(file);
+}
+
+// Adds the pairs that were appended to the file since the last run to the
+// sum and count saved in the state file, so the cost of each run only
+// depends on how much new data there is.  This reads the pairs one at a time
+// without parsing the whole document, so it assumes each pair is a flat
+// object (no '}' inside it) and it stops at the first incomplete one.
+static bool sum_pairs_follow(FILE * file, const char * state_filename,
+  double * sum, size_t * count)
+{
+  FollowState state;
+  follow_state_load(state_filename, &state);
+
+  struct stat st;
+  if (fstat(fileno(file), &st))
+  {
+    fprintf(stderr, "Error: Cannot stat the file.\n");
+    return false;
+  }
+  if (state.offset &&
+    (state.device != (uint64_t)st.st_dev || state.inode != (uint64_t)st.st_ino))
+  {
+    fprintf(stderr, "Warning: This is a different file, starting over.\n");
+    state = (FollowState){ 0 };
+  }
+  state.device = st.st_dev;
+  state.inode = st.st_ino;
+
+  fseek(file, 0, SEEK_END);
+  size_t file_size = ftell(file);
+  if (file_size < state.offset)
+  {
+    fprintf(stderr, "Warning: File got smaller, starting over.\n");
+    state = (FollowState){ .device = st.st_dev, .inode = st.st_ino };
+  }
+
+  profile_block("Follow read");
+  size_t new_size = file_size - state.offset;
+  char * data = malloc(new_size + 1);
+  fseek(file, state.offset, SEEK_SET);
+  new_size = fread(data, 1, new_size, file);
+  data[new_size] = 0;
+  profile_record_bytes(new_size);
+  profile_block_done();
+
+  profile_block("Follow parse");
+  size_t pos = 0;
+  if (state.offset == 0)
+  {
+    // Skip the start of the document, up to the start of the pairs array.
+    char * start = memchr(data, '[', new_size);
+    if (start)
+    {
+      pos = start + 1 - data;
+    }
+    else
+    {
+      // The producer hasn't started the array yet, so leave the offset at 0
+      // and look for it again next time.
+      new_size = 0;
+    }
+  }
+
+  size_t new_count = 0;
+  while (true)
+  {
+    while (pos < new_size && strchr(" \r\n\t,", data[pos])) { pos++; }
+    if (pos >= new_size || data[pos] == ']') { break; }
+    if (data[pos] != '{')
+    {
+      fprintf(stderr, "Error: Expected a pair at offset %llu.\n",
+        (unsigned long long)(state.offset + pos));
+      free(data);
+      return false;
+    }
+
+    char * end = memchr(data + pos, '}', new_size - pos);
+    if (end == NULL) { break; }  // The producer hasn't finished this pair.
+
+    JsonInputBuffer buf = { .data = data + pos,
+      .size = end + 1 - (data + pos) };
+    Json * pair = json_parse_core(&buf);
+    double x0 = json_number(json_object_lookup(pair, "x0"));
+    double y0 = json_number(json_object_lookup(pair, "y0"));
+    double x1 = json_number(json_object_lookup(pair, "x1"));
+    double y1 = json_number(json_object_lookup(pair, "y1"));
+    double distance = haversine_distance(x0, y0, x1, y1);
+    verify_distance(state.count + new_count, distance);
+    state.sum += distance;
+    json_free(pair);
+
+    new_count++;
+    pos = end + 1 - data;
+  }
+  profile_record_bytes(pos);
+  profile_block_done();
+
+  printf("new pairs: %llu\n", (unsigned long long)new_count);
+  state.offset += pos;
+  state.count += new_count;
+  follow_state_save(state_filename, &state);
+  free(data);
+
+  *sum = state.sum;
+  *count = state.count;
+  return true;
+}
+
+//// Parse cache ///////////////////////////////////////////////////////////////
+
+struct
+{
+  bool used;
+  bool hit;
+  uint64_t load_time;   // checking (and on a hit, mapping) the cache
+  uint64_t parse_time;  // parsing the file, now or when the cache was made
+} cache_report;
+
+// Like sum_pairs_tree, but saves the coordinates in a cache file next to the
+// points file, and uses that instead of parsing if the points file hasn't
+// changed since.  See pair_cache.h.
+static bool sum_pairs_cached(FILE * file, const char * filename,
+  bool lazy_numbers, double * sum, size_t * count)
+{
+  char cache_filename[1024];
+  snprintf(cache_filename, sizeof(cache_filename), "%s.cache", filename);
+  cache_report.used = true;
+
+  uint64_t start_tsc = __rdtsc();
+  PairCache cache;
+  profile_block("Cache load");
+  cache_report.hit = pair_cache_open(&cache, cache_filename, filename);
+  profile_block_done();
+  cache_report.load_time = __rdtsc() - start_tsc;
+
+  if (cache_report.hit)
+  {
+    cache_report.parse_time = cache.header->parse_time;
+    profile_block("Average");
+    const double * c = cache.coords;
+    for (uint64_t i = 0; i < cache.header->pair_count; i++, c += 4)
+    {
+      double distance = haversine_distance(c[0], c[1], c[2], c[3]);
+      verify_distance(i, distance);
+      *sum += distance;
+    }
+    *count = cache.header->pair_count;
+    profile_record_bytes(*count * 4 * sizeof(double));
+    profile_block_done();
+    pair_cache_close(&cache);
+    return true;
+  }
+
+  PairCacheKey key;
+  if (!pair_cache_key(filename, &key, true))
+  {
+    fprintf(stderr, "Error: Cannot read %s.\n", filename);
+    return false;
+  }
+
+  start_tsc = __rdtsc();
+  profile_block("JSON parse");
+  Json * data = json_parse_file(file, lazy_numbers);
   profile_block_done();
 
+  Json * pairs = json_object_lookup(data, "pairs");
+  if (pairs == NULL || pairs->type != JsonArray)
+  {
+    fprintf(stderr, "Error: Cannot find a 'pairs' array in file.\n");
+    return false;
+  }
+
+  profile_block("Average");
+  size_t capacity = 1024;
+  double * coords = malloc(capacity * 4 * sizeof(double));
+  for (Json * pair = pairs->first; pair; pair = pair->next)
+  {
+    if (*count == capacity)
+    {
+      capacity *= 2;
+      coords = realloc(coords, capacity * 4 * sizeof(double));
+    }
+    double * c = coords + *count * 4;
+    c[0] = json_number(json_object_lookup(pair, "x0"));
+    c[1] = json_number(json_object_lookup(pair, "y0"));
+    c[2] = json_number(json_object_lookup(pair, "x1"));
+    c[3] = json_number(json_object_lookup(pair, "y1"));
+    double distance = haversine_distance(c[0], c[1], c[2], c[3]);
+    verify_distance(*count, distance);
+    *sum += distance;
+    *count += 1;
+  }
+  profile_record_bytes(*count * 4 * sizeof(double));
+  profile_block_done();
+  cache_report.parse_time = __rdtsc() - start_tsc;
+
+  profile_block("Cache store");
+  if (!pair_cache_write(cache_filename, &key, coords, *count,
+    cache_report.parse_time))
+  {
+    fprintf(stderr, "Warning: Cannot write %s.\n", cache_filename);
+  }
+  profile_block_done();
+  free(coords);
+  return true;
+}
+
+static void cache_print_report()
+{
+  if (!cache_report.used) { return; }
+  if (cache_report.hit)
+  {
+    printf("Cache hit: %llu us instead of %llu us to parse, saved %lld us\n",
+      (unsigned long long)tsc_to_us(cache_report.load_time),
+      (unsigned long long)tsc_to_us(cache_report.parse_time),
+      (long long)tsc_to_us(cache_report.parse_time) -
+      (long long)tsc_to_us(cache_report.load_time));
+  }
+  else
+  {
+    printf("Cache miss: checking took %llu us, parsing took %llu us\n",
+      (unsigned long long)tsc_to_us(cache_report.load_time),
+      (unsigned long long)tsc_to_us(cache_report.parse_time));
+  }
+}
+
+//// Batch mode ////////////////////////////////////////////////////////////////
+
+typedef struct BatchWorker
+{
+  Thread thread;
+
+  // The text of the current file.  Each worker keeps its buffer for all of
+  // its files so we don't pay for allocating and faulting it in every time.
+  char * buffer;
+  size_t capacity;
+
+  size_t file_count;
+  size_t failure_count;
+  uint64_t byte_count;
+  Profile profile;
+} BatchWorker;
+
+char ** batch_files;
+size_t batch_file_count;
+size_t batch_file_capacity;
+size_t batch_next_file;
+bool batch_lazy_numbers;
+
+static void batch_add_file(const char * filename)
+{
+  if (batch_file_count == batch_file_capacity)
+  {
+    batch_file_capacity = batch_file_capacity ? batch_file_capacity * 2 : 64;
+    batch_files = realloc(batch_files, batch_file_capacity * sizeof(char *));
+  }
+  batch_files[batch_file_count++] = strdup(filename);
+}
+
+// Adds the files named by 'arg' to the batch.  'arg' can be a file name, a
+// wildcard pattern (for shells that don't expand them), or @LIST to read the
+// names from the file LIST, one per line.
+static bool batch_add_input(const char * arg)
+{
+  if (arg[0] == '@')
+  {
+    FILE * list = fopen(arg + 1, "r");
+    if (list == NULL)
+    {
+      fprintf(stderr, "Error: Cannot open %s.\n", arg + 1);
+      return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), list))
+    {
+      line[strcspn(line, "\r\n")] = 0;
+      if (line[0]) { batch_add_file(line); }
+    }
+    fclose(list);
+  }
+  else if (strpbrk(arg, "*?"))
+  {
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(arg, &found);
+    if (find == INVALID_HANDLE_VALUE) { return true; }
+    const char * dir_end = arg;
+    for (const char * p = arg; *p; p++)
+    {
+      if (*p == '/' || *p == '\\') { dir_end = p + 1; }
+    }
+    do
+    {
+      if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) { continue; }
+      char path[1024];
+      snprintf(path, sizeof(path), "%.*s%s", (int)(dir_end - arg), arg,
+        found.cFileName);
+      batch_add_file(path);
+    }
+    while (FindNextFileA(find, &found));
+    FindClose(find);
+#else
+    glob_t matches;
+    if (0 == glob(arg, 0, NULL, &matches))
+    {
+      for (size_t i = 0; i < matches.gl_pathc; i++)
+      {
+        batch_add_file(matches.gl_pathv[i]);
+      }
+      globfree(&matches);
+    }
+#endif
+  }
+  else
+  {
+    batch_add_file(arg);
+  }
+  return true;
+}
+
+static bool batch_process_file(BatchWorker * worker, const char * filename)
+{
+  FILE * file = fopen(filename, "rb");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot open %s.\n", filename);
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (file_size + 1 > worker->capacity)
+  {
+    worker->capacity = file_size + 1;
+    worker->buffer = realloc(worker->buffer, worker->capacity);
+  }
+  size_t size = fread(worker->buffer, 1, file_size, file);
+  fclose(file);
+  if (size == 0)
+  {
+    fprintf(stderr, "Error: %s is empty.\n", filename);
+    return false;
+  }
+  worker->buffer[size] = 0;
+  worker->byte_count += size;
+
+  JsonInputBuffer buf = { .size = size, .data = worker->buffer,
+    .lazy_numbers = batch_lazy_numbers };
+  Json * data = json_parse_core(&buf);
+  double sum = 0;
+  size_t count = 0;
+  bool success = sum_pairs_json(data, &sum, &count);
+  json_free(data);
+  if (!success)
+  {
+    fprintf(stderr, "Error: Failed to process %s.\n", filename);
+    return false;
+  }
+
+  printf("%s: pairs: %llu average: %.15f\n", filename,
+    (unsigned long long)count, sum / count);
+  return true;
+}
+
+static void batch_worker(void * arg)
+{
+  BatchWorker * worker = arg;
+  profile_init();
+  while (true)
+  {
+    size_t i = __atomic_fetch_add(&batch_next_file, 1, __ATOMIC_RELAXED);
+    if (i >= batch_file_count) { break; }
+    if (batch_process_file(worker, batch_files[i]))
+    {
+      worker->file_count++;
+    }
+    else
+    {
+      worker->failure_count++;
+    }
+  }
+  worker->profile = global_profile;
+  free(worker->buffer);
+}
+
+// Processes all the files in the batch on a pool of worker threads, which
+// take the next file from the list whenever they finish one.
+static int run_batch(size_t thread_count)
+{
+  // Calibrate once up front instead of once per file.
+  measure_tsc_frequency();
+
+  BatchWorker * workers = calloc(thread_count, sizeof(BatchWorker));
+  uint64_t start_tsc = __rdtsc();
+  profile_block("Batch");
+  for (size_t i = 0; i < thread_count; i++)
+  {
+    if (!thread_start(&workers[i].thread, batch_worker, &workers[i]))
+    {
+      fprintf(stderr, "Error: Cannot start thread %llu.\n",
+        (unsigned long long)i);
+      exit(1);
+    }
+  }
+
+  size_t file_count = 0, failure_count = 0;
+  uint64_t byte_count = 0;
+  for (size_t i = 0; i < thread_count; i++)
+  {
+    thread_join(&workers[i].thread);
+    file_count += workers[i].file_count;
+    failure_count += workers[i].failure_count;
+    byte_count += workers[i].byte_count;
+    profile_merge(&workers[i].profile);
+  }
+  profile_record_bytes(byte_count);
+  profile_block_done();
+  uint64_t time = __rdtsc() - start_tsc;
+
+  double seconds = time * tsc_units_in_us / 1e6;
+  printf("files: %llu, failed: %llu, threads: %llu\n",
+    (unsigned long long)file_count, (unsigned long long)failure_count,
+    (unsigned long long)thread_count);
+  printf("%.1f files/s, %.2f GiB/s\n", (file_count + failure_count) / seconds,
+    calculate_gib_per_s(byte_count, time));
+
+  sampling_stop();
+  profile_print();
+  free(workers);
+  return failure_count != 0;
+}
+
+//// Main code /////////////////////////////////////////////////////////////////
+
+// Usage: haversine_sum [--tape | --lazy | --records [--compare] |
+//   --follow STATE | --cache] [points.json]
+//   [--verify haversine.f64] [--sample HZ]
+//        haversine_sum --batch [--lazy] [--threads N] [--sample HZ] FILE...
+//
+// --tape: Parse into a JsonTape instead of a tree of Json nodes.
+// --lazy: Only decode the numbers we use, when we first use them.
+// --records: Parse the pairs with a parser made for their exact shape, and
+//   print how many pairs per second it parses.  --compare also times the
+//   generic parser on the same text.
+// --follow STATE: Only read the pairs added since the last run with the same
+//   STATE file, and print the average of all the pairs so far.
+// --cache: Use or make a cache of the coordinates in points.json.cache.
+// --verify ANSWERS: Check every distance against the ones in ANSWERS (the
+//   haversine.f64 file from haversine_gen.rb).  In follow mode, this only
+//   checks the new pairs.
+// --sample HZ: Sample where the time goes HZ times per second of CPU time
+//   (1000 is a good rate), and print the functions (and with PROFILE, the
+//   blocks) the samples landed in.  Works with any mode.
+// --batch: Process many files at once on a pool of threads (one per
+//   processor unless --threads says otherwise), printing a line for each.
+//   A FILE can be a wildcard pattern, or @LIST to read names from LIST.
+int main(int argc, char ** argv)
+{
+  profile_init();
+
+  bool use_tape = false;
+  bool lazy_numbers = false;
+  bool use_records = false;
+  bool compare = false;
+  const char * follow_state_filename = NULL;
+  bool use_cache = false;
+  const char * verify_filename = NULL;
+  unsigned int sample_hz = 0;
+  bool batch = false;
+  size_t thread_count = thread_cpu_count();
+  const char * filename = "points.json";
+  for (int i = 1; i < argc; i++)
+  {
+    if (0 == strcmp(argv[i], "--tape")) { use_tape = true; }
+    else if (0 == strcmp(argv[i], "--lazy")) { lazy_numbers = true; }
+    else if (0 == strcmp(argv[i], "--records")) { use_records = true; }
+    else if (0 == strcmp(argv[i], "--compare")) { compare = true; }
+    else if (0 == strcmp(argv[i], "--cache")) { use_cache = true; }
+    else if (0 == strcmp(argv[i], "--batch")) { batch = true; }
+    else if (0 == strcmp(argv[i], "--follow") && i + 1 < argc)
+    {
+      follow_state_filename = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--verify") && i + 1 < argc)
+    {
+      verify_filename = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--sample") && i + 1 < argc)
+    {
+      sample_hz = strtoul(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc)
+    {
+      thread_count = strtoul(argv[++i], NULL, 10);
+      if (thread_count == 0) { thread_count = 1; }
+    }
+    else if (batch)
+    {
+      if (!batch_add_input(argv[i])) { return 1; }
+    }
+    else { filename = argv[i]; }
+  }
+
+  if (batch && verify_filename)
+  {
+    fprintf(stderr, "Error: --verify only works on a single file.\n");
+    return 1;
+  }
+  if (verify_filename && !verify_open(verify_filename)) { return 1; }
+
+  if (sample_hz && !sampling_start(sample_hz))
+  {
+    fprintf(stderr, "Warning: Cannot start sampling.\n");
+    sample_hz = 0;
+  }
+
+  if (batch)
+  {
+    batch_lazy_numbers = lazy_numbers;
+    int result = run_batch(thread_count);
+    if (sample_hz) { sampling_print(); }
+    return result;
+  }
+
+  // Follow mode saves offsets to fseek to, so it needs the raw bytes.  In
+  // text mode on Windows, fread turns CRLF into LF and the offsets drift.
+  FILE * file = fopen(filename, follow_state_filename ? "rb" : "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot open %s.\n", filename);
+    return 1;
+  }
+
+  double sum = 0;
+  size_t count = 0;
+  bool success;
+  if (follow_state_filename)
+  {
+    success = sum_pairs_follow(file, follow_state_filename, &sum, &count);
+  }
+  else if (use_cache)
+  {
+    success = sum_pairs_cached(file, filename, lazy_numbers, &sum, &count);
+  }
+  else if (use_records)
+  {
+    success = sum_pairs_records_file(file, compare, &sum, &count);
+  }
+  else if (use_tape)
+  {
+    success = sum_pairs_tape(file, &sum, &count);
+  }
+  else
+  {
+    success = sum_pairs_tree(file, lazy_numbers, &sum, &count);
+  }
+  if (!success) { return 1; }
+  double average = sum / count;
+
   profile_block("Print results");
-  printf("pairs: %llu\n", count);
+  printf("pairs: %llu\n", (unsigned long long)count);
   printf("average: %20.15lf\n", average);
   profile_block_done();
 
+  if (sample_hz) { sampling_stop(); }
   profile_print();
+  if (sample_hz) { sampling_print(); }
+  cache_print_report();
+  bool partial = follow_state_filename != NULL;
+  return verify_print_report(average, partial) ? 0 : 1;
 }
@@ -6,6 +6,7 @@ enum JsonType
   JsonObject,  // just like an array, but every other entry is a name
   JsonArray,
   JsonNumber,
+  JsonLazyNumber,  // a JsonNumber that has not been decoded yet
   JsonString,
 
   // Tokens, not part of the final structure returned.
@@ -22,6 +23,7 @@ typedef struct Json
     struct Json * first;
     float number;
     char * string;
+    const char * number_text;  // for JsonLazyNumber
   };
   struct Json * next;
 } Json;
@@ -31,6 +33,11 @@ typedef struct JsonInputBuffer
   size_t index;
   size_t size;
   char * data;
+
+  // If true, numbers are not decoded while parsing.  They become
+  // JsonLazyNumber nodes pointing into 'data', and json_number decodes them
+  // the first time they are used.
+  bool lazy_numbers;
 } JsonInputBuffer;
 
 bool json_is_value(enum JsonType type)
@@ -49,6 +56,80 @@ void unread_char(JsonInputBuffer * buf)
   if (buf->index) { buf->index--; }
 }
 
+// Reads the rest of a number whose first character, 'c', was already read.
+float json_read_number(JsonInputBuffer * buf, char c)
+{
+  // WARNING: buffer overflow below if floats are too long
+  char float_string[256];
+  char * p = float_string;
+  *p++ = c;
+  while (true)
+  {
+    c = next_char(buf);
+    if (c == '-' || (c >= '0' && c <= '9') || c == '.' || c == 'e' ||
+      c == 'E' || c == '+')
+    {
+      *p++ = c;
+    }
+    else
+    {
+      unread_char(buf);
+      break;
+    }
+  }
+  *p = 0;
+  profile_block("jpc - strtod");
+  float number = strtod(float_string, NULL);
+  profile_block_done();
+  return number;
+}
+
+bool json_is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// Skips over the rest of a number whose first character, 'c', was already
+// read, without decoding it.  Returns false if the number doesn't follow
+// the JSON grammar:
+//
+//   [-] (0 | [1-9][0-9]*) [. [0-9]+] [(e|E) [+|-] [0-9]+]
+bool json_skip_number(JsonInputBuffer * buf, char c)
+{
+  if (c == '-') { c = next_char(buf); }
+
+  if (c == '0')
+  {
+    c = next_char(buf);
+  }
+  else if (json_is_digit(c))
+  {
+    do { c = next_char(buf); } while (json_is_digit(c));
+  }
+  else
+  {
+    return false;
+  }
+
+  if (c == '.')
+  {
+    c = next_char(buf);
+    if (!json_is_digit(c)) { return false; }
+    do { c = next_char(buf); } while (json_is_digit(c));
+  }
+
+  if (c == 'e' || c == 'E')
+  {
+    c = next_char(buf);
+    if (c == '+' || c == '-') { c = next_char(buf); }
+    if (!json_is_digit(c)) { return false; }
+    do { c = next_char(buf); } while (json_is_digit(c));
+  }
+
+  unread_char(buf);
+  return true;
+}
+
 Json * json_parse_core(JsonInputBuffer * buf)
 {
   profile_block("json_parse_core");
@@ -80,28 +161,23 @@ Json * json_parse_core(JsonInputBuffer * buf)
   else if (c == '-' || (c >= '0' && c <= '9'))
   {
     profile_block("jpc - number");
-    ret->type = JsonNumber;
-    // WARNING: buffer overflow below if floats are too long
-    char float_string[256];
-    char * p = float_string;
-    float_string[0] = c;
-    while (true)
+    if (buf->lazy_numbers)
     {
-      c = next_char(buf);
-      if (c == '-' || (c >= '0' && c <= '9') || c == '.' || c == 'e')
+      ret->type = JsonLazyNumber;
+      ret->number_text = buf->data + buf->index - 1;
+      if (!json_skip_number(buf, c))
       {
-        *p++ = c;
-      }
-      else
-      {
-        unread_char(buf);
-        break;
+        fprintf(stderr, "Invalid number at offset %llu\n",
+          (unsigned long long)(ret->number_text - buf->data));
+        assert(0);
+        ret->type = JsonTypeNone;
       }
     }
-    *p = 0;
-    profile_block("jpc - strtod");
-    ret->number = strtod(float_string, NULL);
-    profile_block_done();
+    else
+    {
+      ret->type = JsonNumber;
+      ret->number = json_read_number(buf, c);
+    }
     profile_block_done();
   }
   else if (c == '{')
@@ -205,27 +281,67 @@ Json * json_parse_core(JsonInputBuffer * buf)
   return ret;
 }
 
-Json * json_parse_file(FILE * file)
+// Frees a value and everything inside it.
+void json_free(Json * json)
+{
+  if (json->type == JsonObject || json->type == JsonArray)
+  {
+    Json * child = json->first;
+    while (child)
+    {
+      Json * next = child->next;
+      json_free(child);
+      child = next;
+    }
+  }
+  else if (json->type == JsonString)
+  {
+    free(json->string);
+  }
+  free(json);
+}
+
+// With lazy_numbers, the file's text is kept in memory for as long as the
+// returned tree is used.
+Json * json_parse_file(FILE * file, bool lazy_numbers)
 {
   profile_block("json_parse_file");
 
   fseek(file, 0, SEEK_END);
   size_t file_size = ftell(file);
   fseek(file, 0, SEEK_SET);
-  char * data = malloc(file_size);
+  char * data = malloc(file_size + 1);
 
   profile_block("jpf - fread");
   size_t bytes_read = fread(data, 1, file_size, file);
   profile_record_bytes(bytes_read);
   profile_block_done();
 
-  JsonInputBuffer buf = { .size = bytes_read, .data = data };
+  // Makes sure strtod stops if the text ends with a number.
+  data[bytes_read] = 0;
+
+  JsonInputBuffer buf = { .size = bytes_read, .data = data,
+    .lazy_numbers = lazy_numbers };
   Json * r = json_parse_core(&buf);
-  free(data);
+  if (!lazy_numbers) { free(data); }
   profile_block_done();
   return r;
 }
 
+// Returns the value of a number, decoding it first if it is a JsonLazyNumber.
+float json_number(Json * json)
+{
+  if (json->type == JsonLazyNumber)
+  {
+    profile_block("json_number");
+    json->number = strtod(json->number_text, NULL);
+    json->type = JsonNumber;
+    profile_block_done();
+  }
+  assert(json->type == JsonNumber);
+  return json->number;
+}
+
 Json * json_object_lookup(Json * obj, const char * name)
 {
   assert(obj->type == JsonObject);
@@ -236,3 +352,274 @@ Json * json_object_lookup(Json * obj, const char * name)
   }
   return NULL;
 }
+
+
+//// Tape representation ///////////////////////////////////////////////////////
+
+// An alternative to the Json tree where the whole document is one array of
+// fixed-size entries, in the order they appear in the file.  Each container
+// entry stores how many children it has and the index just past its last
+// descendant.  So iterating over an array is a linear scan instead of a
+// chain of dependent loads, the length of an array is known up front, and
+// skipping a subtree takes one step.
+//
+// The children of an object alternate between a key (JsonString) and its
+// value.  Strings point into the input text, which the tape owns.
+
+typedef struct JsonTapeEntry
+{
+  uint8_t type;    // enum JsonType, small to leave room for 'uniform'
+  bool uniform;    // arrays: every element takes the same number of entries
+  uint32_t count;  // containers: number of elements or key/value pairs
+  union {
+    size_t end;    // containers: index just past the last descendant
+    float number;
+    char * string;
+  };
+} JsonTapeEntry;
+
+typedef struct JsonTape
+{
+  JsonTapeEntry * entries;
+  size_t count;
+  size_t capacity;
+  char * data;
+} JsonTape;
+
+size_t json_tape_push(JsonTape * tape, enum JsonType type)
+{
+  if (tape->count == tape->capacity)
+  {
+    tape->capacity *= 2;
+    tape->entries = realloc(tape->entries,
+      tape->capacity * sizeof(JsonTapeEntry));
+  }
+  tape->entries[tape->count] = (JsonTapeEntry){ .type = type };
+  return tape->count++;
+}
+
+// Adds the next value in the input to the tape and returns its type.
+// Tokens like JsonComma are returned but not added.
+enum JsonType json_tape_parse_core(JsonInputBuffer * buf, JsonTape * tape)
+{
+  char c;
+  do
+  {
+    c = next_char(buf);
+  }
+  while (c == ' ' || c == '\n');
+
+  if (c == '"')
+  {
+    size_t index = json_tape_push(tape, JsonString);
+    char * start = buf->data + buf->index;
+    while (next_char(buf) != '"') { }
+    buf->data[buf->index - 1] = 0;
+    tape->entries[index].string = start;
+    return JsonString;
+  }
+  else if (c == '-' || (c >= '0' && c <= '9'))
+  {
+    size_t index = json_tape_push(tape, JsonNumber);
+    tape->entries[index].number = json_read_number(buf, c);
+    return JsonNumber;
+  }
+  else if (c == '{')
+  {
+    size_t index = json_tape_push(tape, JsonObject);
+    uint32_t count = 0;
+    while (true)
+    {
+      enum JsonType type = json_tape_parse_core(buf, tape);
+      if (type == JsonObjectEnd) { break; }
+      assert(type == JsonString);
+      type = json_tape_parse_core(buf, tape);
+      assert(type == JsonColon);
+      type = json_tape_parse_core(buf, tape);
+      assert(json_is_value(type));
+      count++;
+      type = json_tape_parse_core(buf, tape);
+      if (type == JsonObjectEnd) { break; }
+      assert(type == JsonComma);
+    }
+    tape->entries[index].count = count;
+    tape->entries[index].end = tape->count;
+    return JsonObject;
+  }
+  else if (c == '[')
+  {
+    size_t index = json_tape_push(tape, JsonArray);
+    uint32_t count = 0;
+    size_t stride = 0;
+    bool uniform = true;
+    while (true)
+    {
+      size_t element = tape->count;
+      enum JsonType type = json_tape_parse_core(buf, tape);
+      if (type == JsonArrayEnd) { break; }
+      assert(json_is_value(type));
+      if (count == 0) { stride = tape->count - element; }
+      else if (tape->count - element != stride) { uniform = false; }
+      count++;
+      type = json_tape_parse_core(buf, tape);
+      if (type == JsonArrayEnd) { break; }
+      assert(type == JsonComma);
+    }
+    tape->entries[index].count = count;
+    tape->entries[index].uniform = uniform;
+    tape->entries[index].end = tape->count;
+    return JsonArray;
+  }
+  else if (c == ':') { return JsonColon; }
+  else if (c == ',') { return JsonComma; }
+  else if (c == '}') { return JsonObjectEnd; }
+  else if (c == ']') { return JsonArrayEnd; }
+  else
+  {
+    fprintf(stderr, "Unrecognized starting char: %c\n", c);
+    assert(0);
+    return JsonTypeNone;
+  }
+}
+
+JsonTape * json_tape_parse_file(FILE * file)
+{
+  profile_block("json_tape_parse");
+
+  fseek(file, 0, SEEK_END);
+  size_t file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  JsonTape * tape = calloc(sizeof(JsonTape), 1);
+  tape->data = malloc(file_size);
+
+  profile_block("jtpf - fread");
+  size_t bytes_read = fread(tape->data, 1, file_size, file);
+  profile_record_bytes(bytes_read);
+  profile_block_done();
+
+  // Most values take more than 8 bytes of text, so this rarely grows.
+  tape->capacity = bytes_read / 8 + 16;
+  tape->entries = malloc(tape->capacity * sizeof(JsonTapeEntry));
+
+  profile_block("jtpf - parse");
+  JsonInputBuffer buf = { .size = bytes_read, .data = tape->data };
+  json_tape_parse_core(&buf, tape);
+  profile_record_bytes(bytes_read);
+  profile_block_done();
+
+  profile_block_done();
+  return tape;
+}
+
+// Returns the index of the entry after the value at 'index' and all of its
+// descendants.
+size_t json_tape_skip(JsonTape * tape, size_t index)
+{
+  JsonTapeEntry * entry = &tape->entries[index];
+  if (entry->type == JsonObject || entry->type == JsonArray)
+  {
+    return entry->end;
+  }
+  return index + 1;
+}
+
+// Returns the index of element 'i' of the array at 'index'.  This is a
+// single calculation if all the elements take the same number of entries,
+// which is the common case of an array of similar records.  The parser
+// checks that when it makes the tape, because the total size alone can
+// match by chance, like in [[1],2,[3,4]].
+size_t json_tape_array_get(JsonTape * tape, size_t index, size_t i)
+{
+  JsonTapeEntry * array = &tape->entries[index];
+  assert(array->type == JsonArray);
+  assert(i < array->count);
+  size_t first = index + 1;
+  if (array->uniform)
+  {
+    size_t stride = json_tape_skip(tape, first) - first;
+    return first + i * stride;
+  }
+  size_t element = first;
+  while (i--) { element = json_tape_skip(tape, element); }
+  return element;
+}
+
+// Returns the index of the value for 'name' in the object at 'index', or 0
+// if it is not found.  (0 is always the root, so it can't be a value.)
+size_t json_tape_object_lookup(JsonTape * tape, size_t index, const char * name)
+{
+  JsonTapeEntry * obj = &tape->entries[index];
+  assert(obj->type == JsonObject);
+  for (size_t key = index + 1; key < obj->end; key = json_tape_skip(tape, key + 1))
+  {
+    assert(tape->entries[key].type == JsonString);
+    if (0 == strcmp(tape->entries[key].string, name)) { return key + 1; }
+  }
+  return 0;
+}
+
+
+//// Record parser /////////////////////////////////////////////////////////////
+
+// A parser for objects of one fixed shape, where we know the keys and their
+// order ahead of time and every value is a number, like
+// {"x0":1.5,"y0":2,"x1":3,"y1":4}.  Describe the keys with an X macro:
+//
+//   #define PAIR_FIELDS(X) X(x0) X(y0) X(x1) X(y1)
+//   JSON_RECORD(PairRecord, PAIR_FIELDS)
+//
+// That defines a struct PairRecord with a double for each key, and
+//
+//   bool PairRecord_parse(const char ** text, PairRecord * record)
+//
+// which parses one record at *text and moves *text past it.  Each key is
+// checked with a memcmp of a constant size, which compiles to one or two
+// integer compares, and no tokens or strings are allocated.  If the record
+// has any other shape (other keys or order, whitespace, or values that
+// aren't numbers), it returns false, so the caller can use json_parse_core
+// on it instead.  The text must be followed by at least 16 readable bytes.
+
+// Reads a number with strtod, but only if it follows the JSON grammar, since
+// strtod also takes things like hex, inf, nan, and "1." that the generic
+// parser rejects.  Like strtod, this needs the text to end with a character
+// that can't be part of a number, like the NUL at the end of a string.
+bool json_record_number(const char ** text, double * value)
+{
+  const char * p = *text;
+  JsonInputBuffer buf = { .size = SIZE_MAX, .data = (char *)p };
+  if (!json_skip_number(&buf, next_char(&buf))) { return false; }
+  char * end;
+  *value = strtod(p, &end);
+  if (end != p + buf.index) { return false; }
+  *text = end;
+  return true;
+}
+
+#define JSON_RECORD_FIELD(name) double name;
+
+#define JSON_RECORD_PARSE_FIELD(name)                                         \
+  if (*p++ != separator) { return false; }                                    \
+  separator = ',';                                                            \
+  if (memcmp(p, "\"" #name "\":", sizeof("\"" #name "\":") - 1))              \
+  {                                                                           \
+    return false;                                                             \
+  }                                                                           \
+  p += sizeof("\"" #name "\":") - 1;                                          \
+  if (!json_record_number(&p, &record->name)) { return false; }
+
+#define JSON_RECORD(type, FIELDS)                                             \
+  typedef struct type                                                         \
+  {                                                                           \
+    FIELDS(JSON_RECORD_FIELD)                                                 \
+  } type;                                                                     \
+                                                                              \
+  bool type##_parse(const char ** text, type * record)                        \
+  {                                                                           \
+    const char * p = *text;                                                   \
+    char separator = '{';                                                     \
+    FIELDS(JSON_RECORD_PARSE_FIELD)                                           \
+    if (*p++ != '}') { return false; }                                        \
+    *text = p;                                                                \
+    return true;                                                              \
+  }
@@ -0,0 +1,158 @@
+// Checks parts of json.h that are easy to get subtly wrong.
+//
+// Usage: json_test
+//
+// Prints each failed check and exits with 1 if there were any.
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "json.h"
+
+int failures;
+
+#define check(condition) \
+  if (!(condition)) { \
+    fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+    failures++; \
+  }
+
+static JsonTape * tape_from_text(const char * text)
+{
+  FILE * file = tmpfile();
+  fputs(text, file);
+  JsonTape * tape = json_tape_parse_file(file);
+  fclose(file);
+  return tape;
+}
+
+// Compares json_tape_array_get with walking the array one element at a time.
+static void check_array_get(JsonTape * tape, size_t array)
+{
+  size_t element = array + 1;
+  for (size_t i = 0; i < tape->entries[array].count; i++)
+  {
+    check(json_tape_array_get(tape, array, i) == element);
+    element = json_tape_skip(tape, element);
+  }
+  check(element == tape->entries[array].end);
+}
+
+static void test_tape_arrays()
+{
+  JsonTape * tape = tape_from_text(
+    "{\"same\": [{\"x\": 1}, {\"x\": 2}, {\"x\": 3}],"
+    " \"numbers\": [1, 2, 3, 4],"
+    " \"mixed\": [[1], 2, [3, 4]],"
+    " \"empty\": []}");
+
+  size_t same = json_tape_object_lookup(tape, 0, "same");
+  check(tape->entries[same].uniform);
+  check_array_get(tape, same);
+
+  size_t numbers = json_tape_object_lookup(tape, 0, "numbers");
+  check(tape->entries[numbers].uniform);
+  check_array_get(tape, numbers);
+
+  // The elements take 2, 1, and 3 entries, which add up to the same as if
+  // they all took 2, so only the flag from the parser tells them apart.
+  size_t mixed = json_tape_object_lookup(tape, 0, "mixed");
+  check(!tape->entries[mixed].uniform);
+  check_array_get(tape, mixed);
+  check(tape->entries[json_tape_array_get(tape, mixed, 2)].type == JsonArray);
+
+  size_t empty = json_tape_object_lookup(tape, 0, "empty");
+  check(tape->entries[empty].count == 0);
+}
+
+// Checks that json_skip_number accepts 'text' as valid or not, and if valid,
+// that it stops after 'length' characters.
+static void check_skip_number(const char * text, bool valid, size_t length)
+{
+  char data[64];
+  snprintf(data, sizeof(data), "%s,", text);
+  JsonInputBuffer buf = { .size = strlen(data), .data = data };
+  char c = next_char(&buf);
+  if (json_skip_number(&buf, c) != valid)
+  {
+    fprintf(stderr, "json_skip_number(\"%s\") should be %s\n", text,
+      valid ? "valid" : "invalid");
+    failures++;
+  }
+  else if (valid && buf.index != length)
+  {
+    fprintf(stderr, "json_skip_number(\"%s\") stopped after %llu "
+      "characters instead of %llu\n", text, (unsigned long long)buf.index,
+      (unsigned long long)length);
+    failures++;
+  }
+}
+
+static void test_skip_number()
+{
+  check_skip_number("0", true, 1);
+  check_skip_number("-0", true, 2);
+  check_skip_number("123", true, 3);
+  check_skip_number("-1.25", true, 5);
+  check_skip_number("1e10", true, 4);
+  check_skip_number("1.5E+10", true, 7);
+  check_skip_number("-2.5e-3", true, 7);
+
+  // These stop at the end of a valid number, and the caller finds out that
+  // what comes next isn't a comma or the end of a container.
+  check_skip_number("01", true, 1);
+  check_skip_number("1-2e+.", true, 1);
+  check_skip_number("1.5.5", true, 3);
+
+  check_skip_number("-", false, 0);
+  check_skip_number("-a", false, 0);
+  check_skip_number("1.", false, 0);
+  check_skip_number("1.e5", false, 0);
+  check_skip_number("1e", false, 0);
+  check_skip_number("1e+", false, 0);
+  check_skip_number("-2e+.", false, 0);
+  check_skip_number(".5", false, 0);
+}
+
+// Checks that json_record_number reads 'text' only if it is a JSON number.
+static void check_record_number(const char * text, bool valid, double expected)
+{
+  const char * p = text;
+  double value = 0;
+  bool read = json_record_number(&p, &value);
+  if (read != valid || (valid && (value != expected || *p != ',')))
+  {
+    fprintf(stderr, "json_record_number(\"%s\") should be %s\n", text,
+      valid ? "valid" : "invalid");
+    failures++;
+  }
+}
+
+static void test_record_number()
+{
+  check_record_number("12.5,", true, 12.5);
+  check_record_number("-1e3,", true, -1000);
+  check_record_number("0x10,", false, 0);
+  check_record_number("1.,", false, 0);
+  check_record_number("inf,", false, 0);
+  check_record_number("nan,", false, 0);
+}
+
+int main()
+{
+  test_tape_arrays();
+  test_skip_number();
+  test_record_number();
+  if (failures)
+  {
+    fprintf(stderr, "%d checks failed.\n", failures);
+    return 1;
+  }
+  printf("All checks passed.\n");
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Memory latency tester.
+//
+// Everything else in this directory measures throughput, but walking a linked
+// structure like our Json tree (pair->next, entry->next->next) is bound by
+// latency: the address of each load comes from the previous load.  This
+// program builds a chain of pointers that visits every cache line of a working
+// set in a random order and measures how long each hop takes, for working sets
+// from 4 KiB to 1 GiB.
+//
+// Each test is done twice: once with normal 4 KiB pages and once with 2 MB
+// large pages.  The large pages take TLB misses mostly out of the picture, so
+// the difference between the two columns is roughly the cost of the TLB
+// misses.  Large pages need the "Lock pages in memory" privilege
+// (SeLockMemoryPrivilege); if we can't get it, that column is skipped.
+//
+// Output is CSV: working set size, then TSC cycles and nanoseconds per load
+// for 4 KiB pages, then the same for 2 MB pages.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "pointer_chase.h"
+
+const size_t min_size = 4 << 10;
+const size_t max_size = (size_t)1 << 30;
+
+// Number of loads we time in each sample.
+const size_t load_count = 1 << 20;
+
+static bool enable_large_pages()
+{
+  HANDLE token;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token))
+  {
+    return false;
+  }
+  TOKEN_PRIVILEGES tp = { .PrivilegeCount = 1 };
+  tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  bool success = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid);
+  if (success)
+  {
+    AdjustTokenPrivileges(token, false, &tp, 0, NULL, NULL);
+    success = GetLastError() == ERROR_SUCCESS;
+  }
+  CloseHandle(token);
+  return success;
+}
+
+// Returns the best time per load, in TSC cycles.
+static double perform_repeat_test(uint8_t * data, size_t size)
+{
+  void * start = build_chain(data, size);
+  repeat_test_init();
+  while (repeat_test_continue())
+  {
+    repeat_test_sample_start();
+    start = chase_loop(load_count, start);
+    repeat_test_sample_end();
+  }
+  return (double)global_rt.best_time / load_count;
+}
+
+int main()
+{
+  repeat_test_init();
+  printf("tsc_frequency: %llu\n", tsc_frequency);
+
+  uint8_t * small_page_data = VirtualAlloc(0, max_size,
+    MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+  uint8_t * large_page_data = NULL;
+  if (enable_large_pages())
+  {
+    size_t large_page_size = GetLargePageMinimum();
+    size_t large_size = (max_size + large_page_size - 1) & ~(large_page_size - 1);
+    large_page_data = VirtualAlloc(0, large_size,
+      MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+  }
+  if (large_page_data == NULL)
+  {
+    fprintf(stderr, "Warning: Could not allocate large pages, skipping them.\n");
+  }
+
+  printf("size,4k cycles,4k ns,2m cycles,2m ns\n");
+  for (size_t size = min_size; size <= max_size; size <<= 1)
+  {
+    double cycles = perform_repeat_test(small_page_data, size);
+    printf("%zu,%.2f,%.2f", size, cycles, cycles * tsc_units_in_us * 1000);
+    if (large_page_data)
+    {
+      cycles = perform_repeat_test(large_page_data, size);
+      printf(",%.2f,%.2f", cycles, cycles * tsc_units_in_us * 1000);
+    }
+    else
+    {
+      printf(",,");
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,71 @@
+// Loop alignment and front-end tester.
+//
+// Times the loop variants generated by gen_loop_variants.rb, which replace
+// the hand-toggled nops in write_bytes.asm.  Run the generator first to pick
+// which offsets and body sizes get tested (see build.sh).
+//
+// Output is one table per nop size: a row for each loop body size and a
+// column for each offset of the loop start from a 64-byte boundary.  Each
+// cell is the best time per loop iteration, in TSC cycles.  If the core runs
+// at a different clock than the TSC, divide by the ratio between them to get
+// core cycles.
+
+#include <stdlib.h>
+
+#include "profile.h"
+
+#include "loop_variants.h"
+
+// Roughly how many instructions we want to run per sample, so the big loop
+// bodies don't take forever and the small ones still take long enough to
+// time.
+const uint64_t instructions_per_sample = 1 << 24;
+
+static double perform_repeat_test(LoopVariant * v)
+{
+  uint64_t iterations = instructions_per_sample / (v->body + 3);
+  if (iterations < 256) { iterations = 256; }
+
+  repeat_test_init();
+  while (repeat_test_continue())
+  {
+    repeat_test_sample_start();
+    v->func(iterations);
+    repeat_test_sample_end();
+  }
+  return (double)global_rt.best_time / iterations;
+}
+
+int main()
+{
+  repeat_test_init();
+  printf("tsc_frequency: %llu\n", (unsigned long long)tsc_frequency);
+
+  // The generator emits the variants grouped by nop size, then body size,
+  // then offset, so each group of offsets is one row of the table.
+  LoopVariant * row = NULL;
+  for (LoopVariant * v = loop_variants; v->func; v++)
+  {
+    bool new_table = row == NULL || v->nop_size != row->nop_size;
+    bool new_row = new_table || v->body != row->body;
+    if (new_row && row) { printf("\n"); }
+    if (new_table)
+    {
+      printf("\nnop size %u\nbody", v->nop_size);
+      for (LoopVariant * c = v; c->func && c->nop_size == v->nop_size
+        && c->body == v->body; c++)
+      {
+        printf(",o%u", c->offset);
+      }
+      printf("\n");
+    }
+    if (new_row)
+    {
+      printf("%u", v->body);
+      row = v;
+    }
+    printf(",%.2f", perform_repeat_test(v));
+    fflush(stdout);
+  }
+  printf("\n");
+}
@@ -0,0 +1,147 @@
+// Persistent cache of the coordinates in a points file.
+//
+// The first time we process a points file, we save the coordinates of every
+// pair in a cache file next to it, as a header followed by a plain array of
+// doubles.  Later runs map the cache file into memory instead of parsing the
+// JSON again.  The cache is only used if the size, modification time, and
+// content hash of the points file match the ones recorded in its header.
+//
+// This file is released into the public domain.
+
+#include <sys/stat.h>
+
+#include "file_map.h"
+
+#define PAIR_CACHE_MAGIC "HSCACHE1"
+
+// Identifies the contents of a points file.
+typedef struct PairCacheKey
+{
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t hash;
+} PairCacheKey;
+
+// 64 bytes, so the coordinates that follow are well aligned.
+typedef struct PairCacheHeader
+{
+  char magic[8];
+  PairCacheKey key;
+  uint64_t pair_count;
+
+  // How long it took to parse the points file, in TSC cycles, so we can tell
+  // how much time the cache saved.  This assumes the cache is used on the
+  // machine that wrote it.
+  uint64_t parse_time;
+
+  uint64_t reserved[2];
+} PairCacheHeader;
+
+typedef struct PairCache
+{
+  FileMap map;
+  const PairCacheHeader * header;
+  const double * coords;  // x0, y0, x1, y1 for each pair
+} PairCache;
+
+// A simple hash that does 32 bytes per step in four independent lanes, so
+// it runs at several bytes per cycle, which is much faster than parsing.
+uint64_t pair_cache_hash(const uint8_t * data, size_t size)
+{
+  const uint64_t k = 0x9E3779B97F4A7C15;
+  uint64_t h[4] = { size, k, k * 3, k * 5 };
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+  {
+    for (int lane = 0; lane < 4; lane++)
+    {
+      uint64_t word;
+      memcpy(&word, data + i + lane * 8, 8);
+      h[lane] = (h[lane] ^ word) * k;
+      h[lane] ^= h[lane] >> 29;
+    }
+  }
+  for (; i < size; i++) { h[0] = (h[0] ^ data[i]) * k; }
+  uint64_t r = h[0] ^ h[1] * 3 ^ h[2] * 5 ^ h[3] * 7;
+  return r ^ r >> 32;
+}
+
+// Gets the key of a points file.  The hash is only computed if 'hash' is
+// true, since it means reading the whole file.
+bool pair_cache_key(const char * filename, PairCacheKey * key, bool hash)
+{
+  struct stat st;
+  if (stat(filename, &st)) { return false; }
+  *key = (PairCacheKey){ .size = st.st_size, .mtime = st.st_mtime };
+  if (!hash) { return true; }
+
+  FileMap map;
+  if (!file_map_open(&map, filename)) { return false; }
+  profile_block("Cache hash");
+  key->hash = pair_cache_hash(map.data, map.size);
+  profile_record_bytes(map.size);
+  profile_block_done();
+  file_map_close(&map);
+  return true;
+}
+
+// Maps the cache file and checks that it matches the points file.  Returns
+// false (a miss) if the cache is missing, damaged, or out of date.
+bool pair_cache_open(PairCache * cache, const char * cache_filename,
+  const char * source_filename)
+{
+  *cache = (PairCache){ 0 };
+  if (!file_map_open(&cache->map, cache_filename)) { return false; }
+
+  const PairCacheHeader * header = (const void *)cache->map.data;
+  PairCacheKey key;
+  bool valid = cache->map.size >= sizeof(PairCacheHeader) &&
+    0 == memcmp(header->magic, PAIR_CACHE_MAGIC, 8) &&
+    cache->map.size == sizeof(PairCacheHeader) +
+      header->pair_count * 4 * sizeof(double) &&
+    pair_cache_key(source_filename, &key, false) &&
+    key.size == header->key.size && key.mtime == header->key.mtime &&
+    pair_cache_key(source_filename, &key, true) &&
+    key.hash == header->key.hash;
+  if (!valid)
+  {
+    file_map_close(&cache->map);
+    return false;
+  }
+
+  cache->header = header;
+  cache->coords = (const double *)(header + 1);
+  return true;
+}
+
+void pair_cache_close(PairCache * cache)
+{
+  file_map_close(&cache->map);
+}
+
+// Writes a new cache file.  We write to a temporary file and rename it, so
+// another run never sees a half-written cache.
+bool pair_cache_write(const char * cache_filename, PairCacheKey * key,
+  const double * coords, uint64_t pair_count, uint64_t parse_time)
+{
+  char temp_filename[1024];
+  snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", cache_filename);
+  FILE * file = fopen(temp_filename, "wb");
+  if (file == NULL) { return false; }
+
+  PairCacheHeader header = {
+    .key = *key,
+    .pair_count = pair_count,
+    .parse_time = parse_time,
+  };
+  memcpy(header.magic, PAIR_CACHE_MAGIC, 8);
+  bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(coords, 4 * sizeof(double), pair_count, file) == pair_count;
+  success = fclose(file) == 0 && success;
+
+  // On Windows, rename fails if the destination exists.
+  remove(cache_filename);
+  success = success && rename(temp_filename, cache_filename) == 0;
+  if (!success) { remove(temp_filename); }
+  return success;
+}
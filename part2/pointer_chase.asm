@@ -0,0 +1,25 @@
+; Pointer-chasing kernel for measuring load-to-use latency.  Every load
+; depends on the result of the previous one, so the loop runs at exactly one
+; load latency per load.
+
+global chase_loop
+
+%include "abi.inc"
+
+section .text
+
+; rcx = arg 0 = number of loads, must be a multiple of 4
+; rdx = arg 1 = pointer to the first node of the chain
+; rax = return value = the last node we loaded (so the loads aren't dead)
+align 64
+chase_loop:
+  WIN64_ARGS
+  mov rax, rdx
+.loop:
+  mov rax, [rax]
+  mov rax, [rax]
+  mov rax, [rax]
+  mov rax, [rax]
+  sub rcx, 4
+  jnle .loop
+  ret
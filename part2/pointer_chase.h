@@ -0,0 +1,42 @@
+// Builds and walks the random pointer chains used to measure memory latency.
+// chase_loop is in pointer_chase.asm.
+
+#define LINE_SIZE 64
+
+void * chase_loop(size_t load_count, void * start);
+
+static uint64_t xorshift_state = 0x2545F4914F6CDD1D;
+
+static uint64_t xorshift()
+{
+  uint64_t x = xorshift_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return xorshift_state = x;
+}
+
+// Links the first 'size' bytes of 'data' into a single cycle that visits
+// every cache line exactly once in a random order (Sattolo's algorithm), so
+// the hardware prefetchers can't guess the next address.
+static void * build_chain(uint8_t * data, size_t size)
+{
+  size_t line_count = size / LINE_SIZE;
+  uint32_t * order = malloc(line_count * sizeof(uint32_t));
+  for (size_t i = 0; i < line_count; i++) { order[i] = i; }
+  for (size_t i = line_count - 1; i > 0; i--)
+  {
+    size_t j = xorshift() % i;
+    uint32_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (size_t i = 0; i < line_count; i++)
+  {
+    void ** node = (void **)(data + (size_t)order[i] * LINE_SIZE);
+    *node = data + (size_t)order[(i + 1) % line_count] * LINE_SIZE;
+  }
+  void * start = data + (size_t)order[0] * LINE_SIZE;
+  free(order);
+  return start;
+}
@@ -1,19 +1,43 @@
 // Note: For cycle-accurate profiling results on a chip that has
 // Intel Turbo Boost, set the Windows "Maximum Processor State" power setting
 // to 99% and don't interact with other applications while running the tests
-// (interacting with Google Chrome seems to enable boosting).
+// (interacting with Google Chrome seems to enable boosting).  The repetition
+// tester's stable mode (repeat_test_stable) can detect and leave out samples
+// that were disturbed anyway.
+//
+// This file works on Windows and on Linux.
+//
+// Define PROFILE to enable profile_block.  Also define PROFILE_ALLOCATIONS to
+// count the calls to malloc, calloc, realloc, and free made after including
+// this file, and the time spent in them, for each block.
 //
 // This file is released into the public domain.
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
 #include <windows.h>
 #include <psapi.h>
+#else
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <x86intrin.h>
+#endif
 
 uint64_t tsc_frequency;
 float tsc_units_in_us;
 
+#ifdef _WIN32
 void measure_tsc_frequency()
 {
   const unsigned int k = 10;  // We measure for 1/k seconds
@@ -34,6 +58,24 @@ void measure_tsc_frequency()
   tsc_frequency = (__rdtsc() - tsc_start) * k;
   tsc_units_in_us = 1e6 / tsc_frequency;
 }
+#else
+void measure_tsc_frequency()
+{
+  const unsigned int k = 10;  // We measure for 1/k seconds
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t tsc_start = __rdtsc();
+  while (true)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = (now.tv_sec - start.tv_sec) * 1000000000LL +
+      (now.tv_nsec - start.tv_nsec);
+    if (ns > 1000000000LL / k) { break; }
+  }
+  tsc_frequency = (__rdtsc() - tsc_start) * k;
+  tsc_units_in_us = 1e6 / tsc_frequency;
+}
+#endif
 
 uint64_t tsc_to_us(uint64_t tsc)
 {
@@ -70,6 +112,14 @@ typedef struct ProfileBlock
   // Total number of bytes this block processed.
   size_t byte_count;
 
+  // Calls to the allocator made while this block was at the top of the
+  // stack, the bytes they asked for, and the time they took.  Only counted
+  // with PROFILE_ALLOCATIONS.
+  size_t allocation_count;
+  size_t free_count;
+  size_t allocation_bytes;
+  uint64_t allocation_time;
+
 } ProfileBlock;
 
 typedef struct ProfileFrame
@@ -90,12 +140,16 @@ typedef struct Profile
 #ifdef PROFILE
   ProfileBlock blocks[PROFILE_BLOCK_CAPACITY];
   ProfileFrame frames[64];
-  size_t block_count;
   size_t frame_count;
+
+  // Allocator calls made outside of any block.
+  ProfileBlock unattributed;
 #endif
 } Profile;
 
-Profile global_profile;
+// Each thread has its own profile, so threads can use profile_block without
+// locking.  Use profile_merge to combine them.
+__thread Profile global_profile;
 
 void profile_init()
 {
@@ -105,11 +159,38 @@ void profile_init()
 }
 
 #ifdef PROFILE
+// Block indexes are shared by all threads, so a block has the same index in
+// every thread's profile.
+size_t profile_block_count;
+
 size_t profile_next_block_index()
 {
-  Profile * profile = &global_profile;
-  assert(profile->block_count < PROFILE_BLOCK_CAPACITY);
-  return profile->block_count++;
+  size_t index = __atomic_fetch_add(&profile_block_count, 1, __ATOMIC_RELAXED);
+  assert(index < PROFILE_BLOCK_CAPACITY);
+  return index;
+}
+
+// Returns the block index stored in *slot, assigning one the first time.
+// If two threads race to assign it, one index is wasted but both threads
+// agree on the result.
+size_t profile_block_index(int * slot)
+{
+  int index = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (index == -1)
+  {
+    int expected = -1;
+    int new_index = profile_next_block_index();
+    if (__atomic_compare_exchange_n(slot, &expected, new_index, false,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      index = new_index;
+    }
+    else
+    {
+      index = expected;
+    }
+  }
+  return index;
 }
 
 // Note: The string pointed to by 'name' should stay in scope
@@ -141,7 +222,7 @@ void profile_record_bytes(size_t bytes)
 // #define profile_block(name) profile_block_start(name, __COUNTER__)
 
 #define profile_block(name) profile_block_start(name, \
-  ({ static int i = -1; if (i == -1) i = profile_next_block_index(); i; }))
+  ({ static int i = -1; profile_block_index(&i); }))
 
 void profile_block_done()
 {
@@ -169,10 +250,101 @@ void profile_block_done()
     frame->block->total_time += total_time;
   }
 }
+
+void profile_merge_allocations(ProfileBlock * dest, ProfileBlock * src)
+{
+  dest->allocation_count += src->allocation_count;
+  dest->free_count += src->free_count;
+  dest->allocation_bytes += src->allocation_bytes;
+  dest->allocation_time += src->allocation_time;
+}
+
+// Adds the blocks from another thread's profile to this thread's profile,
+// including the allocator calls made outside of any block.
+// Time spent by several threads at once gets added up, so the merged blocks
+// can add up to more than the total run time.
+void profile_merge(Profile * from)
+{
+  Profile * profile = &global_profile;
+  assert(from->frame_count == 0);
+  for (size_t i = 0; i < PROFILE_BLOCK_CAPACITY; i++)
+  {
+    ProfileBlock * src = &from->blocks[i];
+    ProfileBlock * dest = &profile->blocks[i];
+    if (src->name == NULL) { continue; }
+    dest->name = src->name;
+    dest->total_time += src->total_time;
+    dest->exclusive_time += src->exclusive_time;
+    dest->entrance_count += src->entrance_count;
+    dest->byte_count += src->byte_count;
+    profile_merge_allocations(dest, src);
+  }
+  profile_merge_allocations(&profile->unattributed, &from->unattributed);
+}
+
+#ifdef PROFILE_ALLOCATIONS
+// Charges an allocator call to the innermost block on the stack.
+ProfileBlock * profile_allocation_block()
+{
+  Profile * profile = &global_profile;
+  if (profile->frame_count == 0) { return &profile->unattributed; }
+  return profile->frames[profile->frame_count - 1].block;
+}
+
+void * profile_malloc(size_t size)
+{
+  uint64_t start_tsc = __rdtsc();
+  void * p = malloc(size);
+  ProfileBlock * block = profile_allocation_block();
+  block->allocation_time += __rdtsc() - start_tsc;
+  block->allocation_count++;
+  block->allocation_bytes += size;
+  return p;
+}
+
+void * profile_calloc(size_t count, size_t size)
+{
+  uint64_t start_tsc = __rdtsc();
+  void * p = calloc(count, size);
+  ProfileBlock * block = profile_allocation_block();
+  block->allocation_time += __rdtsc() - start_tsc;
+  block->allocation_count++;
+  block->allocation_bytes += count * size;
+  return p;
+}
+
+void * profile_realloc(void * old, size_t size)
+{
+  uint64_t start_tsc = __rdtsc();
+  void * p = realloc(old, size);
+  ProfileBlock * block = profile_allocation_block();
+  block->allocation_time += __rdtsc() - start_tsc;
+  block->allocation_count++;
+  block->allocation_bytes += size;
+  return p;
+}
+
+void profile_free(void * p)
+{
+  if (p == NULL) { return; }
+  uint64_t start_tsc = __rdtsc();
+  free(p);
+  ProfileBlock * block = profile_allocation_block();
+  block->allocation_time += __rdtsc() - start_tsc;
+  block->free_count++;
+}
+
+// Everything after this point allocates through the functions above.
+#define malloc(size) profile_malloc(size)
+#define calloc(count, size) profile_calloc(count, size)
+#define realloc(p, size) profile_realloc(p, size)
+#define free(p) profile_free(p)
+#endif
 #else
 #define profile_block(name)
 #define profile_record_bytes(bytes)
 #define profile_block_done()
+#define profile_merge(from)
 #endif
 
 void profile_end()
@@ -181,6 +353,24 @@ void profile_end()
   profile->end_tsc = __rdtsc();
 }
 
+#if defined(PROFILE) && defined(PROFILE_ALLOCATIONS)
+// Prints the allocator calls per entry to the block, and the share of the
+// block's exclusive time that went to the allocator.
+void profile_print_allocations(ProfileBlock * block)
+{
+  if (block->allocation_count == 0 && block->free_count == 0) { return; }
+  double entrances = block->entrance_count ? block->entrance_count : 1;
+  printf(" | allocs %.1f, frees %.1f, %.0f bytes per entry",
+    block->allocation_count / entrances, block->free_count / entrances,
+    block->allocation_bytes / entrances);
+  if (block->exclusive_time)
+  {
+    printf(" (%.1f%% of time)",
+      100.0 * block->allocation_time / block->exclusive_time);
+  }
+}
+#endif
+
 void profile_print()
 {
   Profile * profile = &global_profile;
@@ -190,7 +380,8 @@ void profile_print()
   if (tsc_frequency == 0) { measure_tsc_frequency(); }
 
   uint64_t total_time = profile->end_tsc - profile->start_tsc;
-  printf("Total run time:                 %10llu us\n", tsc_to_us(total_time));
+  printf("Total run time:                 %10llu us\n",
+    (unsigned long long)tsc_to_us(total_time));
 #if PROFILE
   assert(profile->frame_count == 0);
   for (size_t i = 0; i < PROFILE_BLOCK_CAPACITY; i++)
@@ -201,9 +392,9 @@ void profile_print()
     float percent = 100.0 * block->exclusive_time / total_time;
     printf("  %-18s %10llu %10llu us %10llu us (%4.1f%%)",
       block->name,
-      block->entrance_count,
-      tsc_to_us(block->total_time),
-      tsc_to_us(block->exclusive_time),
+      (unsigned long long)block->entrance_count,
+      (unsigned long long)tsc_to_us(block->total_time),
+      (unsigned long long)tsc_to_us(block->exclusive_time),
       percent);
 
     if (block->byte_count)
@@ -211,13 +402,31 @@ void profile_print()
       printf(" %4.2f GiB/s", calculate_gib_per_s(block->byte_count,
         block->total_time));
     }
+#ifdef PROFILE_ALLOCATIONS
+    profile_print_allocations(block);
+#endif
     printf("\n");
   }
+#ifdef PROFILE_ALLOCATIONS
+  if (profile->unattributed.allocation_count ||
+    profile->unattributed.free_count)
+  {
+    // Not a block, so there are no entries to divide by.
+    ProfileBlock * block = &profile->unattributed;
+    printf("  %-18s | allocs %llu, frees %llu, %llu bytes, %llu us\n",
+      "(no block)",
+      (unsigned long long)block->allocation_count,
+      (unsigned long long)block->free_count,
+      (unsigned long long)block->allocation_bytes,
+      (unsigned long long)tsc_to_us(block->allocation_time));
+  }
+#endif
 #endif
 }
 
 //// Page faults ///////////////////////////////////////////////////////////////
 
+#ifdef _WIN32
 HANDLE metrics_handle = INVALID_HANDLE_VALUE;
 
 uint64_t get_total_page_faults()
@@ -232,9 +441,53 @@ uint64_t get_total_page_faults()
   GetProcessMemoryInfo(metrics_handle, (void *)&mc, sizeof(mc));
   return mc.PageFaultCount;
 }
+#else
+uint64_t get_total_page_faults()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+#endif
+
+//// CPU pinning ///////////////////////////////////////////////////////////////
+
+// Makes the calling thread run only on the given logical processor, so that
+// timings don't include migrations between cores.  Returns true on success.
+bool pin_to_cpu(unsigned int cpu)
+{
+#ifdef _WIN32
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+  // Same layout as cpu_set_t, which needs _GNU_SOURCE.
+  uint64_t mask[16] = { 0 };
+  if (cpu >= sizeof(mask) * 8) { return false; }
+  mask[cpu / 64] = (uint64_t)1 << cpu % 64;
+  return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0;
+#endif
+}
 
 //// Repeat testing ////////////////////////////////////////////////////////////
 
+// Stable mode.  Set repeat_test_stable before repeat_test_init to make the
+// tester pin itself to a core (repeat_test_cpu, or the one it is on), warm
+// up until the clock speed settles, and leave out samples that were
+// disturbed by a migration, a frequency change, or an interrupt.  The clock
+// speed and interrupts are measured with the perf cycles and ref-cycles
+// counters, so that part only works on Linux, and only if perf_event_paranoid
+// allows it.  Without the counters, only migrations are caught.
+bool repeat_test_stable;
+int repeat_test_cpu = -1;
+
+// Warm-up is over when the last few samples ran at the same clock speed,
+// within this fraction.
+#define REPEAT_TEST_RATIO_WINDOW 8
+#define REPEAT_TEST_RATIO_TOLERANCE 0.01
+
+// A sample ran at a different clock speed if its cycles per reference
+// cycle moved by more than this fraction from the warmed-up speed.
+#define REPEAT_TEST_FREQUENCY_TOLERANCE 0.02
+
 typedef struct RepeatTest
 {
   bool timing;
@@ -243,10 +496,107 @@ typedef struct RepeatTest
   uint64_t start_tsc;
   size_t test_count;
   uint64_t first_times[4];
+
+  // Samples that came within 1% of the best time, so we can tell if the
+  // best time was a fluke.
+  size_t near_best_count;
+
+  // Stable mode
+  bool warming_up;
+  bool warmup_failed;
+  bool has_counters;
+  uint64_t warmup_start_tsc;
+  unsigned int start_cpu;
+  uint64_t start_cycles;
+  uint64_t start_ref_cycles;
+  double ratios[REPEAT_TEST_RATIO_WINDOW];
+  size_t ratio_count;
+  double base_ratio;
+  size_t flagged_count;
+  size_t migration_count;
+  size_t frequency_count;
+  size_t interrupt_count;
 } RepeatTest;
 
+typedef enum RepeatTestConfidence
+{
+  ConfidenceLow,
+  ConfidenceMedium,
+  ConfidenceHigh,
+} RepeatTestConfidence;
+
 struct RepeatTest global_rt;
 
+// How long repeat_test_continue keeps going after the last best time.
+uint64_t repeat_test_timeout_us = 3000000;
+
+// How long stable mode waits for the clock speed to settle.
+uint64_t repeat_test_warmup_timeout_us = 5000000;
+
+#ifdef _WIN32
+bool repeat_test_open_counters() { return false; }
+
+bool repeat_test_read_counters(uint64_t * cycles, uint64_t * ref_cycles)
+{
+  return false;
+}
+#else
+int repeat_test_perf_fd = -1;
+
+int repeat_test_perf_open(uint64_t config, int group_fd)
+{
+  struct perf_event_attr attr = { 0 };
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Opens the core cycle and reference cycle counters for this thread, as
+// one group so they are read together.  They only count in user mode, so
+// time spent handling interrupts shows up as a gap between the reference
+// cycles and the TSC.
+bool repeat_test_open_counters()
+{
+  static bool tried;
+  if (tried) { return repeat_test_perf_fd >= 0; }
+  tried = true;
+  int leader = repeat_test_perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (leader < 0) { return false; }
+  if (repeat_test_perf_open(PERF_COUNT_HW_REF_CPU_CYCLES, leader) < 0)
+  {
+    close(leader);
+    return false;
+  }
+  repeat_test_perf_fd = leader;
+  return true;
+}
+
+bool repeat_test_read_counters(uint64_t * cycles, uint64_t * ref_cycles)
+{
+  uint64_t values[3];  // count, cycles, ref-cycles
+  if (read(repeat_test_perf_fd, values, sizeof(values)) != sizeof(values))
+  {
+    return false;
+  }
+  *cycles = values[1];
+  *ref_cycles = values[2];
+  return true;
+}
+#endif
+
+// The logical processor we're running on, from the TSC_AUX value that
+// Linux and Windows keep there.
+unsigned int repeat_test_current_cpu()
+{
+  unsigned int aux;
+  __rdtscp(&aux);
+  return aux & 0xFFF;
+}
+
 void repeat_test_init()
 {
   RepeatTest * rt = &global_rt;
@@ -255,37 +605,607 @@ void repeat_test_init()
     .best_time = ~(uint64_t)0,
     .best_time_tsc = __rdtsc(),
   };
+
+  if (repeat_test_stable)
+  {
+    unsigned int cpu = repeat_test_cpu >= 0 ?
+      (unsigned int)repeat_test_cpu : repeat_test_current_cpu();
+    if (!pin_to_cpu(cpu))
+    {
+      fprintf(stderr, "Warning: Cannot pin to CPU %u.\n", cpu);
+    }
+    rt->has_counters = repeat_test_open_counters();
+    rt->warming_up = true;
+    rt->warmup_start_tsc = __rdtsc();
+  }
 }
 
-// Returns true if less than 3 seconds have passed since the best time we
-// recorded.
+// Returns true if less than repeat_test_timeout_us (3 seconds by default)
+// have passed since the best time we recorded.  In stable mode, the timeout
+// only starts when warm-up is over, which repeat_test_warm_up makes sure
+// happens within repeat_test_warmup_timeout_us.
 bool repeat_test_continue()
 {
   RepeatTest * rt = &global_rt;
-  return tsc_to_us(__rdtsc() - rt->best_time_tsc) < 3000000;
+  if (rt->warming_up) { return true; }
+  return tsc_to_us(__rdtsc() - rt->best_time_tsc) < repeat_test_timeout_us;
 }
 
 void repeat_test_sample_start()
 {
   RepeatTest * rt = &global_rt;
+  if (repeat_test_stable)
+  {
+    if (rt->has_counters)
+    {
+      repeat_test_read_counters(&rt->start_cycles, &rt->start_ref_cycles);
+    }
+    rt->start_tsc = __rdtscp(&rt->start_cpu);
+    return;
+  }
   rt->start_tsc = __rdtsc();
 }
 
+// Keeps track of the clock speed during warm-up, and returns true when it
+// has settled.
+bool repeat_test_warm_up(double ratio, uint64_t now_tsc)
+{
+  RepeatTest * rt = &global_rt;
+  uint64_t warmup_time = tsc_to_us(now_tsc - rt->warmup_start_tsc);
+  if (!rt->has_counters)
+  {
+    // Without counters, just run for a while to give the clock time to
+    // come up.
+    return warmup_time >= repeat_test_warmup_timeout_us / 10;
+  }
+
+  rt->ratios[rt->ratio_count++ % REPEAT_TEST_RATIO_WINDOW] = ratio;
+  if (rt->ratio_count >= REPEAT_TEST_RATIO_WINDOW)
+  {
+    double min = rt->ratios[0], max = rt->ratios[0], sum = 0;
+    for (size_t i = 0; i < REPEAT_TEST_RATIO_WINDOW; i++)
+    {
+      if (rt->ratios[i] < min) { min = rt->ratios[i]; }
+      if (rt->ratios[i] > max) { max = rt->ratios[i]; }
+      sum += rt->ratios[i];
+    }
+    if (max - min <= min * REPEAT_TEST_RATIO_TOLERANCE)
+    {
+      rt->base_ratio = sum / REPEAT_TEST_RATIO_WINDOW;
+      return true;
+    }
+  }
+  if (warmup_time >= repeat_test_warmup_timeout_us)
+  {
+    rt->warmup_failed = true;
+    rt->base_ratio = ratio;
+    return true;
+  }
+  return false;
+}
+
+// Returns false if the sample was disturbed and should not count.
+bool repeat_test_check_sample(uint64_t time, uint64_t stop_tsc,
+  unsigned int stop_cpu)
+{
+  RepeatTest * rt = &global_rt;
+  double ratio = 0;
+  bool interrupted = false;
+  uint64_t cycles, ref_cycles;
+  if (rt->has_counters && repeat_test_read_counters(&cycles, &ref_cycles))
+  {
+    cycles -= rt->start_cycles;
+    ref_cycles -= rt->start_ref_cycles;
+    ratio = ref_cycles ? (double)cycles / ref_cycles : 0;
+
+    // Reference cycles tick at the TSC rate, but only in user mode.  Allow
+    // a little slack for reading the counters.
+    interrupted = time > ref_cycles + ref_cycles / 100 + 5000;
+  }
+
+  if (rt->warming_up)
+  {
+    rt->warming_up = !repeat_test_warm_up(ratio, stop_tsc);
+    if (!rt->warming_up) { rt->best_time_tsc = stop_tsc; }
+    return false;
+  }
+
+  bool migrated = stop_cpu != rt->start_cpu;
+  bool frequency_changed = rt->has_counters &&
+    (ratio < rt->base_ratio * (1 - REPEAT_TEST_FREQUENCY_TOLERANCE) ||
+     ratio > rt->base_ratio * (1 + REPEAT_TEST_FREQUENCY_TOLERANCE));
+  rt->migration_count += migrated;
+  rt->frequency_count += frequency_changed;
+  rt->interrupt_count += interrupted;
+  if (migrated || frequency_changed || interrupted)
+  {
+    rt->flagged_count++;
+    return false;
+  }
+  return true;
+}
+
 void repeat_test_sample_end()
 {
   RepeatTest * rt = &global_rt;
 
-  uint64_t stop_tsc = __rdtsc();
+  unsigned int stop_cpu = 0;
+  uint64_t stop_tsc = repeat_test_stable ? __rdtscp(&stop_cpu) : __rdtsc();
   uint64_t time = stop_tsc - rt->start_tsc;
+  if (repeat_test_stable)
+  {
+    bool warming_up = rt->warming_up;
+    bool clean = repeat_test_check_sample(time, stop_tsc, stop_cpu);
+    if (warming_up) { return; }
+    if (!clean)
+    {
+      rt->test_count++;
+      return;
+    }
+  }
+
   if (time < rt->best_time)
   {
+    // The old best still counts as near if the new one is close to it.
+    bool near = rt->best_time != ~(uint64_t)0 &&
+      time * 101 >= rt->best_time * 100;
+    rt->near_best_count = near ? rt->near_best_count + 1 : 1;
     rt->best_time = time;
     rt->best_time_tsc = stop_tsc;
     //printf("Maybe best time: %llu us\n", tsc_to_us(rt->best_time));
   }
+  else if (time * 100 <= rt->best_time * 101)
+  {
+    rt->near_best_count++;
+  }
   if (rt->test_count < 4)
   {
     rt->first_times[rt->test_count] = time;
   }
   rt->test_count++;
 }
+
+// Returns false if the last test has no best time, because stable mode left
+// out every sample.
+bool repeat_test_has_result()
+{
+  RepeatTest * rt = &global_rt;
+  return !rt->warming_up && rt->best_time != ~(uint64_t)0;
+}
+
+// How much the best time of the last test can be trusted.  It is high if
+// the best time came up several times, few samples were disturbed, and (in
+// stable mode) the clock speed was steady.
+RepeatTestConfidence repeat_test_confidence()
+{
+  RepeatTest * rt = &global_rt;
+  size_t samples = rt->test_count ? rt->test_count : 1;
+  double flagged = (double)rt->flagged_count / samples;
+  if (rt->near_best_count >= 3 && flagged <= 0.1 && repeat_test_stable &&
+    rt->has_counters && !rt->warmup_failed)
+  {
+    return ConfidenceHigh;
+  }
+  if (rt->near_best_count >= 2 && flagged <= 0.5) { return ConfidenceMedium; }
+  return ConfidenceLow;
+}
+
+const char * repeat_test_confidence_name(RepeatTestConfidence confidence)
+{
+  static const char * names[] = { "low", "medium", "high" };
+  return names[confidence];
+}
+
+// Prints the confidence in the last test and why.
+void repeat_test_print_confidence()
+{
+  RepeatTest * rt = &global_rt;
+  printf("  confidence: %s (best time reached %llu times within 1%%",
+    repeat_test_confidence_name(repeat_test_confidence()),
+    (unsigned long long)rt->near_best_count);
+  if (repeat_test_stable)
+  {
+    printf("; %llu of %llu samples left out: %llu migrated, "
+      "%llu frequency changes, %llu interrupted",
+      (unsigned long long)rt->flagged_count,
+      (unsigned long long)rt->test_count,
+      (unsigned long long)rt->migration_count,
+      (unsigned long long)rt->frequency_count,
+      (unsigned long long)rt->interrupt_count);
+    if (!rt->has_counters) { printf("; no perf counters"); }
+    if (rt->warmup_failed) { printf("; clock speed never settled"); }
+  }
+  printf(")\n");
+}
+
+//// Sampling profiler /////////////////////////////////////////////////////////
+
+// An alternative to profile_block that doesn't change the code it measures.
+// sampling_start makes the OS interrupt the program 'hz' times per second of
+// CPU time, and each time we record the instruction pointer and, in builds
+// with PROFILE, which blocks are on the stack.  sampling_print shows which
+// functions and blocks the samples landed in.  At 1000 Hz the cost is about
+// a microsecond per millisecond, so it works on full-speed builds.
+//
+// The timer can't fire more often than the kernel's tick (often 250 Hz), so
+// sampling_print shows the rate we really got, from the number of samples
+// and the CPU time.
+//
+// Function names come from addr2line, so they need a build with -g.  In
+// files without debug info, like a stripped libc, addr2line can only find
+// the nearest exported symbol, which is sometimes the wrong function.  Those
+// names are marked with a '~' and the file, like "~free (libc.so.6)".  This
+// is only implemented on Linux.
+
+#define SAMPLE_CAPACITY (1 << 20)
+
+struct
+{
+  unsigned int hz;
+  double cpu_seconds;  // CPU time at sampling_start, then how much was used
+  bool running;
+  uint64_t * ips;
+  size_t count;
+  size_t dropped_count;
+#ifdef PROFILE
+  size_t no_block_count;
+  size_t block_exclusive[PROFILE_BLOCK_CAPACITY];
+  size_t block_inclusive[PROFILE_BLOCK_CAPACITY];
+#endif
+} sampling;
+
+#ifndef _WIN32
+#ifdef PROFILE
+// Counts each block on this thread's stack once, and the innermost one as
+// exclusive.  The stack might be in the middle of changing, so we check
+// every frame before using it.
+void sampling_record_blocks()
+{
+  Profile * profile = &global_profile;
+  size_t frame_count = profile->frame_count;
+  if (frame_count > 64) { return; }
+  if (frame_count == 0)
+  {
+    __atomic_fetch_add(&sampling.no_block_count, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  for (size_t i = 0; i < frame_count; i++)
+  {
+    size_t index = profile->frames[i].block - profile->blocks;
+    if (index >= PROFILE_BLOCK_CAPACITY) { continue; }
+    bool outermost = true;
+    for (size_t j = 0; j < i; j++)
+    {
+      if (profile->frames[j].block == profile->frames[i].block)
+      {
+        outermost = false;
+      }
+    }
+    if (outermost)
+    {
+      __atomic_fetch_add(&sampling.block_inclusive[index], 1,
+        __ATOMIC_RELAXED);
+    }
+    if (i == frame_count - 1)
+    {
+      __atomic_fetch_add(&sampling.block_exclusive[index], 1,
+        __ATOMIC_RELAXED);
+    }
+  }
+}
+#endif
+
+void sampling_signal_handler(int signal, siginfo_t * info, void * context)
+{
+  (void)signal;
+  (void)info;
+  // Index 16 is REG_RIP, which is only defined with _GNU_SOURCE.
+  uint64_t ip = ((ucontext_t *)context)->uc_mcontext.gregs[16];
+  size_t i = __atomic_fetch_add(&sampling.count, 1, __ATOMIC_RELAXED);
+  if (i < SAMPLE_CAPACITY)
+  {
+    sampling.ips[i] = ip;
+  }
+  else
+  {
+    __atomic_fetch_add(&sampling.dropped_count, 1, __ATOMIC_RELAXED);
+  }
+#ifdef PROFILE
+  sampling_record_blocks();
+#endif
+}
+
+double sampling_cpu_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+bool sampling_start(unsigned int hz)
+{
+  // Measure the TSC now, so the 100 ms it takes doesn't show up in the
+  // samples when profile_print needs it.
+  if (tsc_frequency == 0) { measure_tsc_frequency(); }
+
+  sampling.hz = hz;
+  sampling.ips = malloc(SAMPLE_CAPACITY * sizeof(uint64_t));
+  if (sampling.ips == NULL) { return false; }
+  struct sigaction action = { 0 };
+  action.sa_sigaction = sampling_signal_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL)) { return false; }
+
+  long interval = 1000000 / hz;
+  struct itimerval timer = {
+    .it_interval = { .tv_sec = interval / 1000000,
+      .tv_usec = interval % 1000000 },
+    .it_value = { .tv_sec = interval / 1000000,
+      .tv_usec = interval % 1000000 },
+  };
+  sampling.cpu_seconds = sampling_cpu_seconds();
+  sampling.running = setitimer(ITIMER_PROF, &timer, NULL) == 0;
+  return sampling.running;
+}
+
+void sampling_stop()
+{
+  if (!sampling.running) { return; }
+  struct itimerval timer = { 0 };
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sampling.cpu_seconds = sampling_cpu_seconds() - sampling.cpu_seconds;
+  sampling.running = false;
+}
+
+typedef struct SampleFunction
+{
+  char name[128];
+  size_t count;
+} SampleFunction;
+
+typedef struct SampleAddress
+{
+  uint64_t ip;
+  size_t count;
+  SampleFunction * function;
+} SampleAddress;
+
+int sampling_compare_ips(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int sampling_compare_functions(const void * a, const void * b)
+{
+  const SampleFunction * x = a, * y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+typedef struct SampleMapping
+{
+  uint64_t start;
+  uint64_t end;
+  uint64_t base;  // subtract from an address to get the one for addr2line
+  char path[256];
+} SampleMapping;
+
+// Reads the mapped files from /proc/self/maps, and special mappings like
+// [vdso], which we can't look up with addr2line.
+size_t sampling_read_maps(SampleMapping * mappings, size_t capacity)
+{
+  FILE * maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) { return 0; }
+  char line[1024];
+  size_t count = 0;
+  while (count < capacity && fgets(line, sizeof(line), maps))
+  {
+    unsigned long long start, end, offset;
+    SampleMapping * m = &mappings[count];
+    if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %255s", &start, &end,
+      &offset, m->path) < 4 || (m->path[0] != '/' && m->path[0] != '['))
+    {
+      continue;
+    }
+
+    // Executables that aren't position-independent (ELF type 2) use
+    // run-time addresses, everything else addresses relative to the file.
+    uint16_t type = 0;
+    FILE * elf = m->path[0] == '/' ? fopen(m->path, "rb") : NULL;
+    if (elf)
+    {
+      fseek(elf, 16, SEEK_SET);
+      if (fread(&type, sizeof(type), 1, elf) != 1) { type = 0; }
+      fclose(elf);
+    }
+    m->start = start;
+    m->end = end;
+    m->base = type == 2 ? 0 : start - offset;
+    count++;
+  }
+  fclose(maps);
+  return count;
+}
+
+void sampling_add_function(const char * name, size_t count,
+  SampleFunction * functions, size_t * function_count)
+{
+  for (size_t f = 0; f < *function_count; f++)
+  {
+    if (0 == strcmp(functions[f].name, name))
+    {
+      functions[f].count += count;
+      return;
+    }
+  }
+  SampleFunction * function = &functions[(*function_count)++];
+  snprintf(function->name, sizeof(function->name), "%s", name);
+  function->count = count;
+}
+
+// Looks up the function for each address (which must be sorted) with
+// addr2line, running it once for up to 256 addresses in the same file.
+void sampling_name_functions(SampleAddress * addresses, size_t address_count,
+  SampleFunction * functions, size_t * function_count)
+{
+  static SampleMapping mappings[512];
+  size_t mapping_count = sampling_read_maps(mappings, 512);
+
+  size_t i = 0;
+  while (i < address_count)
+  {
+    SampleMapping * mapping = NULL;
+    for (size_t m = 0; m < mapping_count && !mapping; m++)
+    {
+      if (addresses[i].ip >= mappings[m].start &&
+        addresses[i].ip < mappings[m].end) { mapping = &mappings[m]; }
+    }
+    if (mapping == NULL)
+    {
+      sampling_add_function("??", addresses[i].count, functions,
+        function_count);
+      i++;
+      continue;
+    }
+
+    size_t end = i + 1;
+    while (end < address_count && end - i < 256 &&
+      addresses[end].ip < mapping->end) { end++; }
+
+    if (mapping->path[0] == '[')
+    {
+      for (size_t k = i; k < end; k++)
+      {
+        sampling_add_function(mapping->path, addresses[k].count, functions,
+          function_count);
+      }
+      i = end;
+      continue;
+    }
+
+    char command[8192];
+    int length = snprintf(command, sizeof(command), "addr2line -f -e '%s'",
+      mapping->path);
+    for (size_t k = i; k < end; k++)
+    {
+      length += snprintf(command + length, sizeof(command) - length,
+        " 0x%llx", (unsigned long long)(addresses[k].ip - mapping->base));
+    }
+    snprintf(command + length, sizeof(command) - length, " 2>/dev/null");
+
+    // addr2line prints the function and then the file and line, which is
+    // "??" if the file has no debug info.
+    FILE * pipe = popen(command, "r");
+    const char * file = strrchr(mapping->path, '/') + 1;
+    for (size_t k = i; k < end; k++)
+    {
+      char name[128] = "??";
+      char location[512] = "??";
+      if (pipe && fgets(name, sizeof(name), pipe))
+      {
+        name[strcspn(name, "\n")] = 0;
+        if (!fgets(location, sizeof(location), pipe)) { strcpy(name, "??"); }
+      }
+      char approximate[128 + 256 + 8];
+      if (0 == strcmp(name, "??"))
+      {
+        snprintf(approximate, sizeof(approximate), "?? (%s)", file);
+        sampling_add_function(approximate, addresses[k].count, functions,
+          function_count);
+      }
+      else if (0 == strncmp(location, "??", 2))
+      {
+        snprintf(approximate, sizeof(approximate), "~%s (%s)", name, file);
+        sampling_add_function(approximate, addresses[k].count, functions,
+          function_count);
+      }
+      else
+      {
+        sampling_add_function(name, addresses[k].count, functions,
+          function_count);
+      }
+    }
+    if (pipe) { pclose(pipe); }
+    i = end;
+  }
+}
+
+void sampling_print()
+{
+  sampling_stop();
+  size_t count = sampling.count < SAMPLE_CAPACITY ?
+    sampling.count : SAMPLE_CAPACITY;
+  printf("Samples: %llu in %.3f s of CPU time (%.0f Hz, %u Hz asked for)",
+    (unsigned long long)sampling.count, sampling.cpu_seconds,
+    sampling.cpu_seconds > 0 ? sampling.count / sampling.cpu_seconds : 0.0,
+    sampling.hz);
+  if (sampling.dropped_count)
+  {
+    printf(" (only the first %llu kept)", (unsigned long long)count);
+  }
+  printf("\n");
+  if (count == 0) { return; }
+
+  // Count the samples at each address, then add up the addresses by
+  // function, so we only run addr2line once per address.
+  qsort(sampling.ips, count, sizeof(uint64_t), sampling_compare_ips);
+  SampleAddress * addresses = calloc(count, sizeof(SampleAddress));
+  size_t address_count = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (address_count == 0 ||
+      addresses[address_count - 1].ip != sampling.ips[i])
+    {
+      addresses[address_count++].ip = sampling.ips[i];
+    }
+    addresses[address_count - 1].count++;
+  }
+
+  SampleFunction * functions = calloc(address_count, sizeof(SampleFunction));
+  size_t function_count = 0;
+  sampling_name_functions(addresses, address_count, functions,
+    &function_count);
+  qsort(functions, function_count, sizeof(SampleFunction),
+    sampling_compare_functions);
+
+  printf("  Function                               Samples\n");
+  for (size_t i = 0; i < function_count; i++)
+  {
+    printf("  %-36s %10llu (%4.1f%%)\n", functions[i].name,
+      (unsigned long long)functions[i].count,
+      100.0 * functions[i].count / count);
+  }
+  free(functions);
+  free(addresses);
+
+#ifdef PROFILE
+  printf("  Block                        Samples  Exclusive\n");
+  for (size_t i = 0; i < PROFILE_BLOCK_CAPACITY; i++)
+  {
+    if (sampling.block_inclusive[i] == 0) { continue; }
+    const char * name = global_profile.blocks[i].name;
+    printf("  %-22s %10llu (%4.1f%%) %10llu (%4.1f%%)\n",
+      name ? name : "?",
+      (unsigned long long)sampling.block_inclusive[i],
+      100.0 * sampling.block_inclusive[i] / sampling.count,
+      (unsigned long long)sampling.block_exclusive[i],
+      100.0 * sampling.block_exclusive[i] / sampling.count);
+  }
+  printf("  %-22s %10llu (%4.1f%%)\n", "(no block)",
+    (unsigned long long)sampling.no_block_count,
+    100.0 * sampling.no_block_count / sampling.count);
+#endif
+}
+#else
+bool sampling_start(unsigned int hz)
+{
+  (void)hz;
+  fprintf(stderr, "Warning: The sampling profiler only works on Linux.\n");
+  return false;
+}
+
+void sampling_stop() { }
+
+void sampling_print() { }
+#endif
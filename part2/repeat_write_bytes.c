@@ -5,7 +5,7 @@ void mov_all_bytes_asm(unsigned int count, void * data);
 int main()
 {
   repeat_test_init();
-  printf("tsc_frequency: %llu\n", tsc_frequency);
+  printf("tsc_frequency: %llu\n", (unsigned long long)tsc_frequency);
 
   size_t data_size = (size_t)256 * 1024 * 1024;
   char * data = malloc(data_size);
@@ -20,8 +20,10 @@ int main()
     // }
     repeat_test_sample_end();
   }
-  printf("Best time: %llu cycles\n", global_rt.best_time);
-  printf("Best time: %llu us\n", tsc_to_us(global_rt.best_time));
+  printf("Best time: %llu cycles\n",
+    (unsigned long long)global_rt.best_time);
+  printf("Best time: %llu us\n",
+    (unsigned long long)tsc_to_us(global_rt.best_time));
   printf("Bandwidth: %4.2f GiB/s\n", calculate_gib_per_s(data_size, global_rt.best_time));
   printf("Cycles per byte: %.3lf\n", (double)global_rt.best_time / data_size);
 }
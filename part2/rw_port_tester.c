@@ -24,8 +24,10 @@ static inline void perform_repeat_test(void (*func)(size_t, void *),
     func(data_length, data);
     repeat_test_sample_end();
   }
-  printf("Best time: %llu cycles\n", global_rt.best_time);
-  printf("Best time: %llu us\n", tsc_to_us(global_rt.best_time));
+  printf("Best time: %llu cycles\n",
+    (unsigned long long)global_rt.best_time);
+  printf("Best time: %llu us\n",
+    (unsigned long long)tsc_to_us(global_rt.best_time));
   printf("Bandwidth: %4.2f GiB/s\n", calculate_gib_per_s(data_length, global_rt.best_time));
   printf("Cycles per op: %.3lf\n", (double)global_rt.best_time / data_length);
   printf("\n");
@@ -34,7 +36,7 @@ static inline void perform_repeat_test(void (*func)(size_t, void *),
 int main()
 {
   repeat_test_init();
-  printf("tsc_frequency: %llu\n", tsc_frequency);
+  printf("tsc_frequency: %llu\n", (unsigned long long)tsc_frequency);
 
   size_t data_size = (size_t)256 * 1024 * 1024;
   char * data = malloc(data_size);
@@ -0,0 +1,169 @@
+; Write kernels with different store widths and types, and read kernels with
+; software prefetching.  Every kernel processes 128 bytes per iteration, so
+; data_length must be a multiple of 128 and data must be 64-byte aligned.
+
+global write_16, write_32, write_64
+global nt_write_16, nt_write_32, nt_write_64
+global rep_stosb
+global read_plain, read_prefetch
+
+%include "abi.inc"
+
+section .text
+
+; rcx = arg 0 = data_length
+; rdx = arg 1 = data
+align 64
+write_16:
+  WIN64_ARGS
+  pxor xmm0, xmm0
+.loop:
+  movdqa [rdx + 0], xmm0
+  movdqa [rdx + 16], xmm0
+  movdqa [rdx + 32], xmm0
+  movdqa [rdx + 48], xmm0
+  movdqa [rdx + 64], xmm0
+  movdqa [rdx + 80], xmm0
+  movdqa [rdx + 96], xmm0
+  movdqa [rdx + 112], xmm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  ret
+
+align 64
+write_32:
+  WIN64_ARGS
+  vpxor ymm0, ymm0, ymm0
+.loop:
+  vmovdqa [rdx + 0], ymm0
+  vmovdqa [rdx + 32], ymm0
+  vmovdqa [rdx + 64], ymm0
+  vmovdqa [rdx + 96], ymm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  vzeroupper
+  ret
+
+; Requires AVX-512.
+align 64
+write_64:
+  WIN64_ARGS
+  vpxord zmm0, zmm0, zmm0
+.loop:
+  vmovdqa64 [rdx + 0], zmm0
+  vmovdqa64 [rdx + 64], zmm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  vzeroupper
+  ret
+
+; The non-temporal stores go around the caches with write-combining, so we
+; need an sfence at the end to make sure they are done before we return.
+
+align 64
+nt_write_16:
+  WIN64_ARGS
+  pxor xmm0, xmm0
+.loop:
+  movntdq [rdx + 0], xmm0
+  movntdq [rdx + 16], xmm0
+  movntdq [rdx + 32], xmm0
+  movntdq [rdx + 48], xmm0
+  movntdq [rdx + 64], xmm0
+  movntdq [rdx + 80], xmm0
+  movntdq [rdx + 96], xmm0
+  movntdq [rdx + 112], xmm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  sfence
+  ret
+
+align 64
+nt_write_32:
+  WIN64_ARGS
+  vpxor ymm0, ymm0, ymm0
+.loop:
+  vmovntdq [rdx + 0], ymm0
+  vmovntdq [rdx + 32], ymm0
+  vmovntdq [rdx + 64], ymm0
+  vmovntdq [rdx + 96], ymm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  sfence
+  vzeroupper
+  ret
+
+; Requires AVX-512.
+align 64
+nt_write_64:
+  WIN64_ARGS
+  vpxord zmm0, zmm0, zmm0
+.loop:
+  vmovntdq [rdx + 0], zmm0
+  vmovntdq [rdx + 64], zmm0
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  sfence
+  vzeroupper
+  ret
+
+; rdi is non-volatile in the Windows calling convention, so we save it.
+; rcx = arg 0 = data_length
+; rdx = arg 1 = data
+align 64
+rep_stosb:
+  WIN64_ARGS
+  push rdi
+  mov rdi, rdx
+  xor eax, eax
+  rep stosb
+  pop rdi
+  ret
+
+; rcx = arg 0 = data_length
+; rdx = arg 1 = data
+align 64
+read_plain:
+  WIN64_ARGS
+.loop:
+  movdqa xmm0, [rdx + 0]
+  movdqa xmm1, [rdx + 16]
+  movdqa xmm2, [rdx + 32]
+  movdqa xmm3, [rdx + 48]
+  movdqa xmm0, [rdx + 64]
+  movdqa xmm1, [rdx + 80]
+  movdqa xmm2, [rdx + 96]
+  movdqa xmm3, [rdx + 112]
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  ret
+
+; rcx = arg 0 = data_length
+; rdx = arg 1 = data
+; r8  = arg 2 = prefetch distance in bytes
+; Prefetching past the end of the buffer is harmless: prefetches don't fault.
+align 64
+read_prefetch:
+  WIN64_ARGS
+.loop:
+  prefetcht0 [rdx + r8]
+  prefetcht0 [rdx + r8 + 64]
+  movdqa xmm0, [rdx + 0]
+  movdqa xmm1, [rdx + 16]
+  movdqa xmm2, [rdx + 32]
+  movdqa xmm3, [rdx + 48]
+  movdqa xmm0, [rdx + 64]
+  movdqa xmm1, [rdx + 80]
+  movdqa xmm2, [rdx + 96]
+  movdqa xmm3, [rdx + 112]
+  add rdx, 128
+  sub rcx, 128
+  jnle .loop
+  ret
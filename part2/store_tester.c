@@ -0,0 +1,134 @@
+// Store and prefetch policy tester.
+//
+// Our output stages write big arrays once and never read them back, so it
+// matters which kind of store we use.  This program times writing a whole
+// buffer with 16, 32, and 64 byte regular stores, the same widths with
+// non-temporal stores (which skip the cache), and rep stosb.  It also times
+// reading a buffer with software prefetching at several distances ahead of
+// the loads.  Each test is done for buffer sizes from 16 KiB to 1 GiB.
+//
+// Usage: store_tester [prefetch_distance...]
+//
+// Output is CSV: buffer size, then GiB/s for each kernel.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+const size_t min_size = 16 << 10;
+const size_t max_size = (size_t)1 << 30;
+
+void write_16(size_t data_length, void * data);
+void write_32(size_t data_length, void * data);
+void write_64(size_t data_length, void * data);
+void nt_write_16(size_t data_length, void * data);
+void nt_write_32(size_t data_length, void * data);
+void nt_write_64(size_t data_length, void * data);
+void rep_stosb(size_t data_length, void * data);
+void read_plain(size_t data_length, void * data);
+void read_prefetch(size_t data_length, void * data, size_t distance);
+
+typedef struct StoreKernel
+{
+  const char * name;
+  void (*func)(size_t, void *);
+  const char * feature;  // CPU feature needed, or NULL
+} StoreKernel;
+
+StoreKernel kernels[] = {
+  { "write_16", write_16 },
+  { "write_32", write_32, "avx" },
+  { "write_64", write_64, "avx512f" },
+  { "nt_write_16", nt_write_16 },
+  { "nt_write_32", nt_write_32, "avx" },
+  { "nt_write_64", nt_write_64, "avx512f" },
+  { "rep_stosb", rep_stosb },
+  { "read_plain", read_plain },
+  { NULL },
+};
+
+#define MAX_DISTANCES 16
+
+static bool cpu_supports(const char * feature)
+{
+  if (feature == NULL) { return true; }
+  __builtin_cpu_init();
+  if (0 == strcmp(feature, "avx")) { return __builtin_cpu_supports("avx"); }
+  if (0 == strcmp(feature, "avx512f")) { return __builtin_cpu_supports("avx512f"); }
+  return false;
+}
+
+static double perform_repeat_test(void (*func)(size_t, void *),
+  size_t data_length, void * data)
+{
+  repeat_test_init();
+  while (repeat_test_continue())
+  {
+    repeat_test_sample_start();
+    func(data_length, data);
+    repeat_test_sample_end();
+  }
+  return calculate_gib_per_s(data_length, global_rt.best_time);
+}
+
+static double perform_prefetch_repeat_test(size_t distance,
+  size_t data_length, void * data)
+{
+  repeat_test_init();
+  while (repeat_test_continue())
+  {
+    repeat_test_sample_start();
+    read_prefetch(data_length, data, distance);
+    repeat_test_sample_end();
+  }
+  return calculate_gib_per_s(data_length, global_rt.best_time);
+}
+
+int main(int argc, char ** argv)
+{
+  size_t distances[MAX_DISTANCES] = { 256, 512, 1024, 2048, 4096 };
+  size_t distance_count = 5;
+  if (argc > 1)
+  {
+    distance_count = 0;
+    for (int i = 1; i < argc && distance_count < MAX_DISTANCES; i++)
+    {
+      distances[distance_count++] = strtoul(argv[i], NULL, 10);
+    }
+  }
+
+  repeat_test_init();
+  printf("tsc_frequency: %llu\n", tsc_frequency);
+
+  // VirtualAlloc gives us page-aligned memory, which the aligned stores need.
+  uint8_t * data = VirtualAlloc(0, max_size, MEM_RESERVE | MEM_COMMIT,
+    PAGE_READWRITE);
+  memset(data, 1, max_size);
+
+  printf("size");
+  for (StoreKernel * k = kernels; k->name; k++)
+  {
+    if (cpu_supports(k->feature)) { printf(",%s", k->name); }
+  }
+  for (size_t i = 0; i < distance_count; i++)
+  {
+    printf(",prefetch_%zu", distances[i]);
+  }
+  printf("\n");
+
+  for (size_t size = min_size; size <= max_size; size <<= 2)
+  {
+    printf("%zu", size);
+    for (StoreKernel * k = kernels; k->name; k++)
+    {
+      if (!cpu_supports(k->feature)) { continue; }
+      printf(",%4.2f", perform_repeat_test(k->func, size, data));
+    }
+    for (size_t i = 0; i < distance_count; i++)
+    {
+      printf(",%4.2f", perform_prefetch_repeat_test(distances[i], size, data));
+    }
+    printf("\n");
+  }
+}
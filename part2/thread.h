@@ -0,0 +1,74 @@
+// Minimal threads for Windows and Linux.
+//
+// This file is released into the public domain.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct Thread
+{
+  void (*func)(void * arg);
+  void * arg;
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  pthread_t handle;
+#endif
+} Thread;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(void * param)
+{
+  Thread * thread = param;
+  thread->func(thread->arg);
+  return 0;
+}
+#else
+static void * thread_main(void * param)
+{
+  Thread * thread = param;
+  thread->func(thread->arg);
+  return NULL;
+}
+#endif
+
+// Starts running func(arg) on a new thread.  The Thread object must stay
+// valid until thread_join returns.
+bool thread_start(Thread * thread, void (*func)(void *), void * arg)
+{
+  thread->func = func;
+  thread->arg = arg;
+#ifdef _WIN32
+  thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+  return thread->handle != NULL;
+#else
+  return pthread_create(&thread->handle, NULL, thread_main, thread) == 0;
+#endif
+}
+
+void thread_join(Thread * thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+#else
+  pthread_join(thread->handle, NULL);
+#endif
+}
+
+// Returns the number of logical processors we can run on.
+size_t thread_cpu_count()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? count : 1;
+#endif
+}
@@ -1,8 +1,11 @@
 global mov_all_bytes_asm
 
+%include "abi.inc"
+
 section .text
 
 mov_all_bytes_asm:
+  WIN64_ARGS
   xor rax, rax
 .loop:
   ;mov [rdx + rax], al